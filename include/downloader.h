@@ -18,7 +18,9 @@
 #endif // DOWNLOADER_SHARE_LIB
 
 
+#include <map>
 #include <string>
+#include <vector>
 #include <functional>
 #include <filesystem>
 #include <system_error>
@@ -32,6 +34,17 @@ struct download_status
     int64_t processedBytes;         //!< 已处理的字节数
 };
 
+//!
+//! 区间的分配策略
+//!
+enum range_allocation
+{
+    kAllocateSequential = 0,        //!< 从文件头部开始顺序分配
+    kAllocateStrided,               //!< 文件按连接数划分为连续的区域, 每个连接顺序的下载各自的区域, 服务端的读取保持顺序
+    kAllocateTailFirst,             //!< 从文件尾部开始分配, 适用于索引位于末尾的格式
+    kAllocateRandom,                //!< 随机分配
+};
+
 //!
 //! 下载偏好
 //!
@@ -39,14 +52,59 @@ struct download_preference
 {
     int connections = 4;            //!< 下载连接数
     int interval    = 1000 / 10;    //!< 状态汇报的间隔时长(毫秒), 单连接下载时失效
-    int blockSize   = 1024 * 1024;  //!< 连接分块传输的大小, 单连接下载时失效
+    int blockSize   = 1024 * 1024;  //!< 连接分块传输的大小, 开放区间模式下为拆分出的区间的最小值, 单连接下载时失效
     int timeout     = 5000;         //!< 请求的超时时间
 
+    int     checkpointInterval = 5000;              //!< 保存下载进度的间隔(毫秒), 单连接下载时失效
+    int64_t checkpointBytes    = 64 * 1024 * 1024;  //!< 两次保存之间下载的字节数达到该值时提前保存, 0 表示不限制
+    bool    durable            = true;              //!< 保存进度前先将数据同步到磁盘, 保证断电后续传的正确性
+    bool    discard            = false;             //!< 丢弃下载的数据(依然跟踪区间), 不写入磁盘也不续传, 用于测试网络吞吐量
+
+    double  slowRatio  = 0.2;       //!< 连接的速度在统计窗口内低于所有连接速度中位数的该比例时, 换一个新的连接, 0 表示不检测
+    int     slowWindow = 5000;      //!< 慢速连接检测的统计窗口(毫秒)
+    int64_t hedgeBytes = 256 * 1024; //!< 没有可分配的区间时, 空闲的连接重复请求剩余不少于该字节数的在途区间, 先完成者胜出, 0 表示不对冲
+    bool    openEnded  = false;     //!< 开放区间模式: 连接请求 bytes=start- 持续接收, 直到被新加入的连接拆分的位置, 省去每个分块的请求往返
+    bool    requestAhead = false;   //!< 预先请求: 区间即将完成时为下一个区间发起请求, 与当前的传输重叠, 每个连接至多使用两个 TCP 连接(HTTP/2 时复用一个)
+    range_allocation allocation = kAllocateSequential; //!< 区间的分配策略, 单连接下载时失效
+
+    int     stallBytes  = 1024;     //!< 区间请求在 stallWindow 内的平均速度低于该值(字节/秒)时视为停滞, 中止并重新分配未完成的部分, 0 表示不检测
+    int     stallWindow = 20000;    //!< 停滞检测的统计窗口(毫秒), 按秒计时
+    int     idleTimeout = 10000;    //!< 区间请求超过该时间(毫秒)没有收到任何数据时视为停滞, 0 表示不检测
+
     //! 请求头
     std::map<std::string, std::string> header;
 };
 
+//!
+//! 全局选项, 作用于进程内的所有下载
+//!
+struct download_global_options
+{
+    int  threads = 16;              //!< 共享工作线程的数量上限, 所有下载的连接在其中轮转执行
+    bool pinned  = false;           //!< 工作线程是否绑定到 CPU 核心, 仅对之后创建的线程生效
+
+    int64_t memoryBudget  = 64 * 1024 * 1024;   //!< 所有连接的接收缓冲区总量, 不足时连接退回 libcurl 的默认缓冲区(16KiB),
+                                                //!< 即使预算耗尽也会分配, 因此上限为 memoryBudget + 连接数 x 16KiB
+    int     receiveBuffer = 64 * 1024;          //!< 单个连接的接收缓冲区大小, 范围 [16KiB, 512KiB]
+
+    //! 按源站(协议, 主机及端口)记录能力及性能的缓存文件, 为空时不启用. 启用后已知不支持范围请求的源站跳过探测直接单点下载,
+    //! connections 不超过源站可用的连接数, blockSize 按记录的速度及请求的等待时间放大(作为下限)
+    std::filesystem::path originCache;
+};
+
+//! @brief 设置全局选项, 通常在首次下载之前调用
+DOWNLOADER_LIB void SetDownloadGlobalOptions(const download_global_options& options);
+
+//! @brief 获取全局选项
+DOWNLOADER_LIB download_global_options GetDownloadGlobalOptions();
+
+//! @brief 获取运行指标(进程内所有下载的累计值), 以 OpenMetrics 文本格式输出, 可直接作为 Prometheus 的抓取结果
+//! @return 接收的字节数, 请求数, 按类别的请求错误数, 进行中的请求数, 首字节延迟, 磁盘写入及检查点耗时
+DOWNLOADER_LIB std::string GetDownloadMetrics();
+
 //! @brief 下载文件
+//! @note 进程内 url 及请求头相同的并发下载合并为一次传输, 其余调用者等待并获得进度及结果(目标文件不同时复制);
+//!       目标文件相同而 url 不同的下载依次执行.
 //! @param url 文件url
 //! @param filename 存储本地文件名.
 //! @param callback 下载状态回调, 该回调返回false, 将终止加载过程并设置错误码为: kOperationInterrupted
@@ -60,6 +118,21 @@ DOWNLOADER_LIB bool DownloadFile(
     const download_preference config,
     std::error_code& error);
 
+//! @brief 下载到内存
+//! @note 不写入磁盘, 因此不能续传, 也不与其他下载合并; 适用于较小的文件
+//! @param url 文件url
+//! @param data 下载的内容
+//! @param callback 下载状态回调, 该回调返回false, 将终止加载过程并设置错误码为: kOperationInterrupted
+//! @param config 下载策略
+//! @param error 失败时将包含具体的错误原因(BaseError)
+//! @return 成功返回true, 否则失败
+DOWNLOADER_LIB bool DownloadToBuffer(
+    const std::string& url,
+    std::vector<char>& data,
+    const std::function<bool(const download_status&)>& callback,
+    const download_preference config,
+    std::error_code& error);
+
 //! @brief 请求内容
 //! @param url
 //! @param data 请求到的数据
@@ -78,7 +151,12 @@ struct file_attribute
 {
     int64_t     contentLength = -1; //!< 文件长度(字节数), -1 未知文件长度
     std::string contentRange;       //!< 内容范围
-    std::string acceptRanges;       //!< 可以接受的范围请求格式
+    std::string acceptRanges;       //!< 可以接受的范围请求格式, 为空 或 none 表示不支持范围请求
+    std::string etag;               //!< 实体标签, 用于校验续传的内容是否一致
+    std::string lastModified;       //!< 最后修改时间
+    std::string contentEncoding;    //!< 内容编码
+    std::string contentDisposition; //!< 内容描述, 可能包含建议的文件名
+    int64_t     retryAfter = -1;    //!< 建议的重试等待时长(秒), -1 未指定
     std::string header;             //!< http 响应头
 };
 
@@ -0,0 +1,35 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef downloader_asio_h__
+#define downloader_asio_h__
+
+#include <boost/asio/io_context.hpp>
+
+#include "downloader.h"
+
+//! @brief 异步下载文件
+//!
+//! 网络 I/O 由 libcurl 的 multi-socket 接口驱动, 套接字的就绪通知与超时均由 context 的反应器完成,
+//! 下载不会创建专用的线程, 可以与其他网络 I/O 共用 context 的线程.
+//! 持久模式(durable)的检查点及关闭文件需要同步磁盘, 在共享的线程池中执行, 不阻塞 context.
+//! 若 context 由多个线程驱动, 同一个下载的所有回调依然是串行的.
+//!
+//! @param context 驱动下载的 io_context, 在完成回调之前须保持运行
+//! @param url 文件url
+//! @param filename 存储本地文件名.
+//! @param callback 下载状态回调, 在 context 上调用, 返回false将终止下载并设置错误码为: kOperationInterrupted
+//! @param config 下载策略
+//! @param handler 完成回调, 在 context 上调用, 失败时参数包含具体的错误原因(BaseError)
+DOWNLOADER_LIB void AsyncDownloadFile(
+    boost::asio::io_context& context,
+    const std::string& url,
+    const std::filesystem::path& filename,
+    const std::function<bool(const download_status&)>& callback,
+    const download_preference config,
+    const std::function<void(const std::error_code&)>& handler);
+
+#endif // downloader_asio_h__
@@ -0,0 +1,120 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef body_sink_h__
+#define body_sink_h__
+
+#include <atomic>
+#include <string_view>
+#include <system_error>
+
+#include "range_file.hpp"
+#include "http_header.hpp"
+
+//
+// 响应体的接收端
+//
+// 由传输层以原始的 char* 数据块驱动, 数据直接填充至 RangeFile,
+// 不产生额外的内存分配与拷贝.
+//
+class BodySink
+{
+public:
+    virtual ~BodySink() = default;
+
+    // 响应头接收完毕时调用, 返回 false 则丢弃响应体
+    virtual bool accept(long status) {
+        return status == 200 || status == 206;
+    }
+
+    // 返回 false 将中止传输
+    virtual bool write(const char* data, size_t size) = 0;
+
+    // 已接收到所需的全部数据, 此时中止传输不视为错误
+    virtual bool completed() const {
+        return false;
+    }
+};
+
+//
+// 填充区间的接收端, 用于多点下载, flag 非零(下载已终止)时中止传输
+//
+// 有的服务器可能会在下载过程中返回错误信息, 此时下载的内容并不是文件内容,
+// 因此仅当响应是区间的内容时才写入文件.
+//
+class RangeSink : public BodySink
+{
+    RangeFile&             _file;
+    Range2&                _range;
+    std::error_code&       _error;
+    const std::atomic_int& _flag;
+
+public:
+    RangeSink(RangeFile& file, Range2& range, const std::atomic_int& flag, std::error_code& error)
+        : _file(file), _range(range), _error(error), _flag(flag) {
+    }
+
+    bool accept(long status) override {
+        // 服务器忽略了范围请求而返回整个文件时, 仅当区间从头开始才可以使用
+        return status == 206 || (status == 200 && _range.start == 0);
+    }
+
+    bool write(const char* data, size_t size) override {
+        // 超出区间的部分(服务器返回了整个文件, 或开放区间到达了拆分点)不写入, 并中止传输
+        _file.clip(_range);
+        auto remain = _range.end + 1 - _range.position;
+        auto bytes = std::min<int64_t>(remain, size);
+        if (bytes <= 0)
+            return false;
+        if (!_file.fill(_range, std::string_view(data, (size_t)bytes), bytes, _error))
+            return false;
+        return bytes == (int64_t)size && _flag == 0;
+    }
+
+    bool completed() const override {
+        // 对冲的对端已先完成剩余的部分, 中止即是完成
+        return _range.position == _range.end + 1 || _file.superseded(_range);
+    }
+};
+
+//
+// 顺序填充的接收端, 用于未知长度 或 不支持范围请求时的单点下载
+//
+// 续传时请求从已写入的位置开始, 服务器返回整个文件(不支持范围请求 或 If-Range 不匹配)时,
+// 丢弃已写入的数据从头开始, 并以新响应的校验符作为之后续传的依据.
+//
+class StreamSink : public BodySink
+{
+    RangeFile&            _file;
+    std::error_code&      _error;
+    int64_t               _offset   = 0;       // 请求的起始位置
+    const file_attribute* _response = nullptr; // 本次请求的响应头
+
+public:
+    StreamSink(RangeFile& file, std::error_code& error, int64_t offset = 0, const file_attribute* response = nullptr)
+        : _file(file), _error(error), _offset(offset), _response(response) {
+    }
+
+    bool accept(long status) override {
+        if (status == 206)
+            return _offset > 0 && _offset == _file.processed();
+        if (status != 200)
+            return false;
+        if (_file.processed() > 0)
+            _file.rewind(_error); // 失败时由 write() 中止传输
+        if (_response)
+            _file.set_validator(RangeValidator(*_response));
+        return true;
+    }
+
+    bool write(const char* data, size_t size) override {
+        if (_error)
+            return false;
+        return _file.fill(std::string_view(data, size), (int64_t)size, _error);
+    }
+};
+
+#endif // body_sink_h__
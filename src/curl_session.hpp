@@ -0,0 +1,286 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef curl_session_h__
+#define curl_session_h__
+
+#include <map>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cinttypes>
+#include <stdexcept>
+#include <functional>
+#include <curl/curl.h>
+
+#include "metrics.hpp"
+#include "body_sink.hpp"
+#include "http_header.hpp"
+#include "receive_budget.hpp"
+
+//! @brief 构造请求头列表, 自定义的请求头可以覆盖默认值
+//! @return 请求头列表, 需在句柄不再使用后通过 curl_slist_free_all() 释放
+inline curl_slist* CurlMakeHeader(const std::map<std::string, std::string>& header)
+{
+    std::map<std::string, std::string> fields = { {"Connection", "keep-alive"} };
+    for (const auto& item : header)
+        fields[item.first] = item.second;
+
+    curl_slist* chunk = nullptr;
+    for (const auto& item : fields)
+    {
+        std::string line = item.first;
+        if (item.second.empty())
+            line += ";";
+        else
+            line += ": " + item.second;
+
+        curl_slist* temp = curl_slist_append(chunk, line.c_str());
+        if (temp)
+            chunk = temp;
+    }
+    return chunk;
+}
+
+//! @brief 设置 easy 句柄的通用选项: 重定向, 忽略证书校验, 连接超时, 请求头
+//! @return 请求头列表, 需在句柄不再使用后通过 curl_slist_free_all() 释放
+inline curl_slist* CurlSetOptions(
+    CURL* curl,
+    const std::string& url,
+    const std::map<std::string, std::string>& header,
+    int timeout)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)timeout);
+
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 50L);
+    curl_easy_setopt(curl, CURLOPT_POSTREDIR, (long)CURL_REDIR_POST_ALL);
+
+    curl_slist* chunk = CurlMakeHeader(header);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+    return chunk;
+}
+
+//
+// 基于 libcurl easy 接口的会话
+//
+// 响应体通过原始的 char* 写回调直接交给 BodySink, 接收路径上没有内存分配.
+// 接收缓冲区从进程的 ReceiveBudget 中租用, 随会话释放.
+// 会话可以复用以保持连接, 但同一时刻只能执行一个请求.
+//
+class CurlSession
+{
+    CURL*       _curl     = nullptr;
+    curl_slist* _header   = nullptr;
+    BodySink*   _sink     = nullptr;
+    long        _status   = 0;
+    bool        _accepted = false;
+    int         _buffer   = 0;      // 接收缓冲区的大小
+    int         _idle     = 0;      // 读空闲超时(毫秒), 0 表示不限制
+    bool        _stalled  = false;  // 因读空闲超时而中止
+    bool        _active   = false;  // begin() 之后尚未 finish(), 计入进行中的请求
+    int64_t     _received = 0;      // 本次请求最近一次进度回调时已接收的字节数
+    std::chrono::steady_clock::time_point _lastRead;
+
+    std::function<bool(int64_t total, int64_t now)> _progress;
+
+    static size_t WriteBodyCallback(char* data, size_t size, size_t nitems, void* userdata)
+    {
+        auto self = static_cast<CurlSession*>(userdata);
+        size *= nitems;
+        if (self->_sink == nullptr)
+            return size;
+
+        // 首个数据块到达时响应头已经完整, 由接收端决定是否接受响应体
+        if (self->_status == 0)
+        {
+            curl_easy_getinfo(self->_curl, CURLINFO_RESPONSE_CODE, &self->_status);
+            self->_accepted = self->_sink->accept(self->_status);
+        }
+        if (!self->_accepted)
+            return size; // 丢弃
+
+        Metrics::Instance().receivedBytes.add(size);
+        return self->_sink->write(data, size) ? size : 0;
+    }
+
+    static int ProgressCallback(void* userdata,
+        curl_off_t downloadTotal, curl_off_t downloadNow, curl_off_t, curl_off_t)
+    {
+        auto self = static_cast<CurlSession*>(userdata);
+        if (self->_idle > 0)
+        {
+            // 进度回调在空闲时约每秒调用一次, 以此检测长时间没有数据到达的请求
+            auto now = std::chrono::steady_clock::now();
+            if (downloadNow != self->_received) {
+                self->_received = downloadNow;
+                self->_lastRead = now;
+            }
+            else if (now - self->_lastRead >= std::chrono::milliseconds(self->_idle)) {
+                self->_stalled = true;
+                return 1;
+            }
+        }
+        if (self->_progress && !self->_progress(downloadTotal, downloadNow))
+            return 1;
+        return 0;
+    }
+
+    void update_progress()
+    {
+        bool enabled = _progress || _idle > 0;
+        curl_easy_setopt(_curl, CURLOPT_NOPROGRESS, enabled ? 0L : 1L);
+        curl_easy_setopt(_curl, CURLOPT_XFERINFOFUNCTION, enabled ? &ProgressCallback : nullptr);
+        curl_easy_setopt(_curl, CURLOPT_XFERINFODATA, this);
+    }
+
+public:
+    CurlSession(const std::string& url, const std::map<std::string, std::string>& header)
+    {
+        _curl = curl_easy_init();
+        if (_curl == nullptr)
+            throw std::runtime_error("curl_easy_init() failed");
+
+        _header = CurlSetOptions(_curl, url, header, 3000);
+        curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, WriteBodyCallback);
+        curl_easy_setopt(_curl, CURLOPT_WRITEDATA, this);
+
+        _buffer = ReceiveBudget::Instance().acquire();
+        curl_easy_setopt(_curl, CURLOPT_BUFFERSIZE, (long)_buffer);
+    }
+
+    ~CurlSession()
+    {
+        if (_active)
+            Metrics::Instance().connections.add(-1);
+        curl_easy_cleanup(_curl);
+        curl_slist_free_all(_header);
+        ReceiveBudget::Instance().release(_buffer);
+    }
+
+    CurlSession(const CurlSession&) = delete;
+    CurlSession& operator=(const CurlSession&) = delete;
+
+    CURL* handle() const {
+        return _curl;
+    }
+
+    void set_connect_timeout(int timeout) {
+        curl_easy_setopt(_curl, CURLOPT_CONNECTTIMEOUT_MS, (long)timeout);
+    }
+
+    //! 设置请求范围, end < 0 表示直到文件末尾, start < 0 表示取消范围请求
+    void set_range(int64_t start, int64_t end = -1)
+    {
+        if (start < 0) {
+            curl_easy_setopt(_curl, CURLOPT_RANGE, nullptr);
+            return;
+        }
+
+        char range[64] = {};
+        if (end < 0)
+            snprintf(range, sizeof(range), "%" PRId64 "-", start);
+        else
+            snprintf(range, sizeof(range), "%" PRId64 "-%" PRId64, start, end);
+        curl_easy_setopt(_curl, CURLOPT_RANGE, range);
+    }
+
+    //! 替换请求头, 例如续传时附加 If-Range
+    void set_header(const std::map<std::string, std::string>& header)
+    {
+        auto chunk = CurlMakeHeader(header);
+        curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, chunk);
+        curl_slist_free_all(_header);
+        _header = chunk;
+    }
+
+    //! 将每次请求的响应头解析至 attribute, 重定向时只保留最后的响应
+    void set_response_header(file_attribute* attribute)
+    {
+        curl_easy_setopt(_curl, CURLOPT_HEADERFUNCTION, attribute ? &WriteHeadCallback : nullptr);
+        curl_easy_setopt(_curl, CURLOPT_HEADERDATA, attribute);
+    }
+
+    //! 设置进度回调, 回调返回 false 将中止传输
+    void set_progress(std::function<bool(int64_t total, int64_t now)> callback)
+    {
+        _progress = std::move(callback);
+        update_progress();
+    }
+
+    //! 设置停滞检测, 停滞的请求以 CURLE_OPERATION_TIMEDOUT 结束
+    //! @param bytes 在 window 内的平均速度低于该值(字节/秒)时视为停滞, 0 表示不检测
+    //! @param window 统计窗口(毫秒), 由 libcurl 按秒计时
+    //! @param idle 超过该时间(毫秒)没有收到任何数据时视为停滞, 0 表示不检测
+    void set_stall_timeout(int bytes, int window, int idle)
+    {
+        curl_easy_setopt(_curl, CURLOPT_LOW_SPEED_LIMIT, bytes > 0 ? (long)bytes : 0L);
+        curl_easy_setopt(_curl, CURLOPT_LOW_SPEED_TIME, bytes > 0 ? std::max<long>((window + 999) / 1000, 1) : 0L);
+        _idle = std::max(idle, 0);
+        update_progress();
+    }
+
+    CURLcode perform(BodySink& sink)
+    {
+        begin(sink);
+        return finish(curl_easy_perform(_curl));
+    }
+
+    //! 异步执行: 绑定接收端后将 handle() 加入 multi 句柄, 传输结束后以结果调用 finish()
+    void begin(BodySink& sink)
+    {
+        _sink     = &sink;
+        _status   = 0;
+        _accepted = false;
+        _stalled  = false;
+        _received = 0;
+        _lastRead = std::chrono::steady_clock::now();
+
+        auto& metrics = Metrics::Instance();
+        metrics.requests.add();
+        if (!_active)
+            metrics.connections.add(1);
+        _active = true;
+    }
+
+    CURLcode finish(CURLcode code)
+    {
+        if ((code == CURLE_WRITE_ERROR || code == CURLE_ABORTED_BY_CALLBACK) && _sink && _sink->completed())
+            code = CURLE_OK; // 接收端已获得所需的数据而主动中止
+        else if (code == CURLE_ABORTED_BY_CALLBACK && _stalled)
+            code = CURLE_OPERATION_TIMEDOUT; // 读空闲超时, 与低速超时同样归为网络错误
+
+        _sink = nullptr;
+        curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &_status);
+
+        // 首字节的延迟, 仅统计收到响应的请求
+        auto& metrics = Metrics::Instance();
+        curl_off_t latency = 0;
+        if (_status != 0 && curl_easy_getinfo(_curl, CURLINFO_STARTTRANSFER_TIME_T, &latency) == CURLE_OK)
+            metrics.rangeLatency.observe(static_cast<int64_t>(latency));
+        if (_active)
+            metrics.connections.add(-1);
+        _active = false;
+        return code;
+    }
+
+    long status_code() const {
+        return _status;
+    }
+
+    //! 响应体是否被接收端接受
+    bool accepted() const {
+        return _accepted;
+    }
+};
+
+#endif // curl_session_h__
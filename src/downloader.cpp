@@ -4,19 +4,41 @@
 // For the full copyright and license information, please view the LICENSE
 // file that was distributed with this source code.
 
+#include <optional>
+
 #include "nlog.h"
 #include "range.hpp"
 #include "range_file.hpp"
+#include "range_policy.hpp"
+#include "single_flight.hpp"
+#include "origin_cache.hpp"
+#include "metrics.hpp"
+#include "curl_session.hpp"
+#include "http_header.hpp"
+#include "thread_pool.hpp"
+#include "speed_monitor.hpp"
+#include "request_error.hpp"
 #include "downloader.h"
 
 #include "cpr/cpr.h"
 #include "common/scope.hpp"
 #include "common/assert.hpp"
 #include "platform/platform_util.h"
-#include <boost/algorithm/string.hpp>
 
 namespace chr = std::chrono;
 
+static inline download_global_options& GlobalOptions()
+{
+    static download_global_options options;
+    return options;
+}
+
+static inline std::mutex& GlobalOptionsMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
 static inline std::shared_ptr<cpr::Session> MakeSession(
     const cpr::Url& url,
     std::map<std::string, std::string> header)
@@ -36,21 +58,6 @@ static inline std::shared_ptr<cpr::Session> MakeSession(
     return session;
 }
 
-static inline size_t WriteHeadCallback(
-    char* buffer, 
-    size_t size,
-    size_t nitems, 
-    file_attribute* attribute) 
-{
-    size *= nitems;
-    if (strncmp(buffer, "Accept-Ranges:", 14) == 0)
-        attribute->acceptRanges = boost::algorithm::trim_copy(std::string(buffer + 14, size - 14));
-    if (strncmp(buffer, "Content-Range:", 14) == 0)
-        attribute->contentRange = boost::algorithm::trim_copy(std::string(buffer + 14, size - 14));
-    attribute->header.append(buffer, size);
-    return size;
-}
-
 bool GetFileAttribute(file_attribute& attribute, const std::string& url, std::error_code& error)
 {
     return GetFileAttribute(attribute, url, {}, 3000, error);
@@ -72,47 +79,10 @@ bool GetFileAttribute(
             return !(error = util::MakeError(util::kRuntimeError));
         util_scope_exit = [&] { curl_easy_cleanup(curl); };
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
+        // 通用选项 与 请求头
+        curl_slist* chunk = CurlSetOptions(curl, url, header, timeout);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
         curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout);
-
-        cpr::VerifySsl verify{ false };
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, verify ? 1L : 0L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, verify ? 2L : 0L);
-
-        cpr::Redirect redirect{};
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, redirect.follow ? 1L : 0L);
-        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, redirect.maximum);
-        curl_easy_setopt(curl, CURLOPT_UNRESTRICTED_AUTH, redirect.cont_send_cred ? 1L : 0L);
-
-        // NOLINTNEXTLINE (google-runtime-int)
-        long mask = 0;
-        if (cpr::any(redirect.post_flags & cpr::PostRedirectFlags::POST_301))
-            mask |= CURL_REDIR_POST_301;
-        if (cpr::any(redirect.post_flags & cpr::PostRedirectFlags::POST_302))
-            mask |= CURL_REDIR_POST_302;
-        if (cpr::any(redirect.post_flags & cpr::PostRedirectFlags::POST_303))
-            mask |= CURL_REDIR_POST_303;
-        curl_easy_setopt(curl, CURLOPT_POSTREDIR, mask);
-
-        // header setting
-        curl_slist* chunk = nullptr;
-        for (const auto& item : header) {
-            std::string header_string = item.first;
-            if (item.second.empty()) {
-                header_string += ";";
-            }
-            else {
-                header_string += ": " + item.second;
-            }
-
-            curl_slist* temp = curl_slist_append(chunk, header_string.c_str());
-            if (temp) {
-                chunk = temp;
-            }
-        }
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
 
         // header handle
         curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, WriteHeadCallback);
@@ -124,38 +94,7 @@ bool GetFileAttribute(
         CURLcode res = curl_easy_perform(curl);
         curl_slist_free_all(chunk);
 
-        switch (res)
-        {
-        case CURLE_OK: {
-            long status_code{};
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
-            if (200 == status_code || 206 == status_code)
-                curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &attribute.contentLength);
-            if (206 == status_code && attribute.acceptRanges.empty())
-                attribute.acceptRanges = "bytes"; // 这里要确定: 返回206 是否一定表示支持: range: bytes
-        }
-        break;
-
-        case CURLE_RECV_ERROR:
-        case CURLE_SEND_ERROR:
-        case CURLE_COULDNT_RESOLVE_HOST:
-        case CURLE_OPERATION_TIMEDOUT:
-        case CURLE_SSL_CONNECT_ERROR:
-            // 网络错误
-            NLOG_ERR("GetFileAttribute() failed, error: {1}, {2}")
-                % res
-                % curl_easy_strerror(res);
-            error = util::MakeError(util::kNetworkError);
-            break;
-
-        default:
-            // 未知错误 或 运行时错误
-            NLOG_ERR("GetFileAttribute() failed, error: {1}, {2}")
-                % res
-                % curl_easy_strerror(res);
-            error = util::MakeError(util::kRuntimeError);
-            break;
-        }
+        HandleProbeResult(curl, res, attribute, error);
     }
     catch (const std::exception& e)
     {
@@ -166,108 +105,13 @@ bool GetFileAttribute(
     return !error;
 }
 
-enum { kRunning = 0, kFailed, kCancelled };
-
-//
-// 错误处理
-// 致命错误 & 非致命错误
-//   文件系统错误
-//      磁盘已满
-//      权限不足
-//      磁盘无法访问
-//   网络错误
-//      断开连接 ?
-// 返回true, 表示致命错误
-// 
-bool HandleRequestError(
-    const cpr::Response& response, 
-    const std::error_code& fserr, 
-    const std::atomic_int& flag,
-    std::error_code& error)
-{
-    if (fserr)
-    {
-        // 因为文件操作错误终止, 归属为致命错误
-        NLOG_ERR("Filesystem Error: {1}, status_code: {2}")
-            % fserr.message()
-            % response.status_code;
-        error = fserr;
-        return true;
-    }
-
-    switch (response.error.code)
-    {
-    case cpr::ErrorCode::REQUEST_CANCELLED:
-        util_assert(flag != kRunning);
-        if (flag == kCancelled) // 只有取消才改写error
-            error = util::MakeError(util::kOperationInterrupted);
-        return true;
-
-        // 余下的错误, 不好判断是否属于致命错误(因为网络错误可能因为重试变得好转)
-        // 因此, 这里仅设置错误码, 由外部做决断
-    case cpr::ErrorCode::NETWORK_SEND_FAILURE:
-    case cpr::ErrorCode::NETWORK_RECEIVE_ERROR:
-    case cpr::ErrorCode::HOST_RESOLUTION_FAILURE:
-    case cpr::ErrorCode::CONNECTION_FAILURE:
-    case cpr::ErrorCode::OPERATION_TIMEDOUT:
-    case cpr::ErrorCode::SSL_CONNECT_ERROR:
-        // 网络错误
-        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
-            % response.status_code
-            % int(response.error.code)
-            % response.error.message;
-        error = util::MakeError(util::kNetworkError);
-        return false;
-
-    case cpr::ErrorCode::INTERNAL_ERROR:
-    case cpr::ErrorCode::EMPTY_RESPONSE:
-        // 未知错误 或 运行时错误
-        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
-            % response.status_code
-            % int(response.error.code)
-            % response.error.message;
-        error = util::MakeError(util::kNetworkError);
-        return false;
-
-    case cpr::ErrorCode::OK:
-        if (200 == response.status_code || 206 == response.status_code)
-            return false; // 成功
-
-        if (404 == response.status_code) { // 资源不存在
-            error = util::MakeError(util::kFileNotFound);
-            return true;
-        }
-
-        if (503 == response.status_code) { // 服务不可用
-            error = util::MakeError(util::kServerError);
-            return true;
-        }
-
-        if (400 <= response.status_code) { // 下载错误
-            NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
-                % response.status_code
-                % int(response.error.code)
-                % response.error.message;
-            error = util::MakeError(util::kOperationFailed);
-        }
-        return false;
-
-    default:
-        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
-            % response.status_code
-            % int(response.error.code)
-            % response.error.message;
-        error = util::MakeError(util::kRuntimeError);
-    }
-
-    return false;
-}
-
-bool DownloadFile(
+//! @param storage 存储后端, 为空时写入磁盘文件 filename
+static bool PerformDownload(
     const std::string& url, 
     const std::filesystem::path& filename,
+    const std::shared_ptr<RangeStorage>& storage,
     const std::function<bool(const download_status&)>& callback,
-    const download_preference config,
+    download_preference config,
     std::error_code& error
     )
 {
@@ -276,6 +120,15 @@ bool DownloadFile(
     {
         std::atomic_int flag(kRunning);
 
+        // 按源站的记录: 不支持范围请求时单点下载(省去探测), 连接数不超过可用的上限
+        auto& origins = OriginCache::Instance();
+        OriginRecord origin;
+        bool known = origins.find(url, origin);
+        if (known && !origin.ranges)
+            config.connections = 1;
+        else if (known && origin.connections > 0)
+            config.connections = std::min(config.connections, origin.connections);
+
         auto start = chr::steady_clock::now();
         auto measure = [](auto start) -> int {
             return (int)chr::duration_cast<chr::milliseconds>(
@@ -289,6 +142,10 @@ bool DownloadFile(
         NLOG_PRO(" - Connections: ") << config.connections;
         NLOG_PRO(" - BlockSize: ") << config.blockSize;
         NLOG_PRO(" - Interval: ") << config.interval;
+        NLOG_PRO(" - Checkpoint: {1}ms/{2}bytes, durable: {3}")
+            % config.checkpointInterval
+            % config.checkpointBytes
+            % (config.durable ? "true" : "false");
 
         file_attribute attribute = {};
         if (config.connections > 1) //  单点下载不用探测文件长度
@@ -324,10 +181,27 @@ bool DownloadFile(
             NLOG_PRO("GetFileAttribute() -> {1}\r\n{2}")
                 % attribute.contentLength
                 % attribute.header;
+            origins.record_ranges(url, SupportRanges(attribute));
+
+            // 分块按带宽时延积放大, 但每个连接至少分得一个分块
+            if (known && attribute.contentLength > 0)
+            {
+                auto blockSize = OriginCache::BlockSize(origin, config.blockSize);
+                blockSize = (int)std::min<int64_t>(blockSize, attribute.contentLength / config.connections);
+                if (blockSize > config.blockSize)
+                {
+                    NLOG_PRO("Seed the block size by origin, block-size: {1} -> {2}, rate: {3}, latency: {4}us")
+                        % config.blockSize
+                        % blockSize
+                        % origin.rate
+                        % origin.latency;
+                    config.blockSize = blockSize;
+                }
+            }
         }
 
         util::ferror ferr;
-        if (util::file_exist(filename, ferr))
+        if (!storage && util::file_exist(filename, ferr))
             util::file_remove(filename, ferr);
         if (ferr) {
             NLOG_ERR("util::file_*() failed, error: ") << ferr.message();
@@ -335,6 +209,7 @@ bool DownloadFile(
         }
 
         RangeFile rf;
+        rf.set_storage(storage);
         util_scope_exit = [&] {
             auto finished = !error;
             std::error_code ecode;
@@ -346,29 +221,16 @@ bool DownloadFile(
             }
         };
 
-        auto session1 = MakeSession(url, config.header);
         if (attribute.contentLength == -1 || 
             attribute.contentLength <= config.blockSize ||
-            attribute.acceptRanges.empty())
+            !SupportRanges(attribute))
         {
             NLOG_PRO("Direct download ...");
 
             // 未知大小 or 长度太短 or 不支持范围请求, 只能单点下载
-            session1->SetConnectTimeout(config.timeout);
-            session1->SetProgressCallback(cpr::ProgressCallback(
-                [&](cpr::cpr_off_t downloadTotal,
-                    cpr::cpr_off_t downloadNow,
-                    cpr::cpr_off_t, cpr::cpr_off_t, intptr_t) -> bool
-                {
-                    // downloadTotal 很可能为0
-                    if (callback && !callback({ downloadTotal, downloadNow })) {
-                        flag = kCancelled;
-                        return false;
-                    }
-                    return true;
-                }));
-
             rf.reserve(attribute.contentLength);
+            rf.set_durable(config.durable);
+            rf.set_stream(true);
             if (!rf.open(filename, error)) {
                 NLOG_ERR("rf.open({1}) failed, error: {2}")
                     % filename.wstring()
@@ -376,15 +238,89 @@ bool DownloadFile(
                 return !error;
             }
 
-            cpr::Response response;
+            // 未完成时保存最后的进度, 以便下次续传
+            util_scope_exit = [&] {
+                std::error_code ecode;
+                if (error && !rf.dump(ecode))
+                    NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+            };
+
+            // 响应头用于获取续传的校验符 及 确认服务器支持范围请求
+            file_attribute response;
+            int64_t offset = 0;
+            auto lastDump = chr::steady_clock::now();
+            auto lastDumpBytes = rf.processed();
+
+            auto session1 = std::make_shared<CurlSession>(url, config.header);
+            session1->set_connect_timeout(config.timeout);
+            session1->set_stall_timeout(config.stallBytes, config.stallWindow, config.idleTimeout);
+            session1->set_response_header(&response);
+            session1->set_progress(
+                [&](int64_t downloadTotal, int64_t downloadNow) -> bool
+                {
+                    // downloadTotal 很可能为0
+                    auto processed = rf.processed();
+                    auto total = attribute.contentLength > 0 ? attribute.contentLength :
+                                 downloadTotal > 0 ? offset + downloadTotal : 0;
+                    if (callback && !callback({ total, processed })) {
+                        flag = kCancelled;
+                        return false;
+                    }
+
+                    // 按时间或下载量批量的保存进度, 长时间的单点下载在重启后可以续传
+                    if (measure(lastDump) >= config.checkpointInterval ||
+                        (config.checkpointBytes > 0 && processed - lastDumpBytes >= config.checkpointBytes))
+                    {
+                        std::error_code ecode;
+                        if (!rf.dump(ecode))
+                            NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+                        lastDump = chr::steady_clock::now();
+                        lastDumpBytes = processed;
+                    }
+                    return true;
+                });
+
+            bool ranges = SupportRanges(attribute);
             do 
             {
+                error.clear();
+                if (rf.is_full())
+                    break;
+
+                // 已写入部分数据时从其末尾续传, 存在校验符时附加 If-Range,
+                // 内容已改变 或 服务器不支持范围请求时将返回整个文件
+                offset = rf.processed();
+                auto header = config.header;
+                if (offset > 0 && (ranges || !rf.validator().empty()))
+                {
+                    if (!rf.validator().empty())
+                        header["If-Range"] = rf.validator();
+                    session1->set_range(offset);
+                    NLOG_PRO("Resume the direct download, offset: {1}, validator: {2}")
+                        % offset
+                        % rf.validator();
+                }
+                else
+                {
+                    offset = 0;
+                    session1->set_range(-1);
+                    if (rf.processed() > 0 && !rf.rewind(error))
+                        return !error;
+                }
+                session1->set_header(header);
+
                 std::error_code ecode;
-                response = session1->Download(cpr::WriteCallback{
-                    [&](const std::string& data, intptr_t userdata) -> bool {
-                        return rf.fill(data, data.size(), ecode);
-                    }});
-                if (HandleRequestError(response, ecode, flag, error))
+                StreamSink sink(rf, ecode, offset, &response);
+                auto code = session1->perform(sink);
+                ranges = ranges || SupportRanges(response) || session1->status_code() == 206;
+
+                // 续传的位置恰好是文件的末尾(未知长度时无法预先判断)
+                int64_t first, last, total;
+                if (code == CURLE_OK && session1->status_code() == 416 && offset > 0 &&
+                    ParseContentRange(response.contentRange, first, last, total) && total == offset)
+                    break;
+
+                if (HandleRequestError(session1->status_code(), MakeRequestError(code, flag), ecode, flag, error))
                     return !error; // 致命错误, 直接终止
 
                 if (error.value() == util::kNetworkError)
@@ -393,7 +329,7 @@ bool DownloadFile(
                     if (elapse < config.timeout)
                     {
                         auto timeout = std::max(config.timeout - elapse, 1000);
-                        session1->SetConnectTimeout(timeout);
+                        session1->set_connect_timeout(timeout);
 
                         NLOG_PRO("keep trying, timeout: {1} ...") % timeout;
                         continue;
@@ -404,16 +340,19 @@ bool DownloadFile(
             } 
             while (1);
 
+            if (!error && ranges)
+                origins.record_ranges(url, true);
+
             if (error)
             {
                 NLOG_ERR("Direct download failed, status code: {1}, error: {2}")
-                    % response.status_code
+                    % session1->status_code()
                     % error.message();
             }
             else
             {
                 NLOG_PRO("Direct download finished, status code: {1}")
-                    % response.status_code;
+                    % session1->status_code();
             }
             return !error;
         }
@@ -421,12 +360,26 @@ bool DownloadFile(
         NLOG_PRO("Multipoint download ...");
 
         rf.reserve(attribute.contentLength, config.blockSize);
+        rf.set_durable(config.durable);
+        rf.set_open_ended(config.openEnded);
+        rf.set_policy(MakeRangePolicy(config.allocation), config.connections);
         if(!rf.open(filename, error)) {
             NLOG_ERR("RangeFile::open() failed, error: ") << error.message();
             return !error;
         }
 
-        // 工作线程状态
+        // 一个区间的传输
+        struct Transfer {
+            std::shared_ptr<CurlSession> session;
+            Range2                       range;
+            std::error_code              ecode;
+            std::optional<RangeSink>     sink;
+            bool                         active = false;      // 区间已分配, 尚未归还
+            bool                         done   = false;      // 请求已结束
+            CURLcode                     code   = CURLE_OK;
+        };
+
+        // 连接状态
         struct State {
             enum { 
                 kThreadNone = 0, 
@@ -435,58 +388,237 @@ bool DownloadFile(
                 kThreadInterrupted 
             };
             int flag = kThreadNone;
+            int index = 0;
+            SpeedMeter meter;
             std::error_code error;
+
+            // 传输由连接独占的 multi 句柄驱动, 下载终止时由监视线程唤醒;
+            // 预先请求模式下两个传输交替进行
+            std::shared_ptr<CURLM> multi;
+            Transfer transfers[2];
+            int current = 0;
+            int64_t latency = 0;    // 最近一次请求的等待时间(发出请求至收到首字节, 微秒)
+            int64_t rate    = 0;    // 最近一次请求收到首字节之后的速度(字节/秒)
+            bool    served  = false; // 至少完成过一次请求, 用于发现源站的连接数上限
         };
 
-        auto worker = [&](State& state)
+        SpeedMonitor monitor(config.connections, config.slowRatio, config.slowWindow);
+
+        // 创建会话. 测速仅统计当前的传输, 持续明显慢于其他连接时中止, 未完成的部分归还后换一个新的连接;
+        // 对冲的对端已先完成时, 即使没有数据到达也尽快中止
+        auto renew = [&](State& state, Transfer& t)
+        {
+            t.session = std::make_shared<CurlSession>(url, config.header);
+            t.session->set_stall_timeout(config.stallBytes, config.stallWindow, config.idleTimeout);
+            if (monitor.enabled() || config.hedgeBytes > 0) {
+                t.session->set_progress([&, s = &state, p = &t](int64_t, int64_t now) {
+                    if (rf.superseded(p->range))
+                        return false;
+                    return !monitor.enabled() || p != &s->transfers[s->current] || s->meter.update(now);
+                });
+            }
+        };
+
+        // 为传输分配区间. 没有可分配的区间时, 开放区间模式下拆分在途区间, 否则对冲剩余最多的在途区间,
+        // 以免尾声阶段由最慢的连接决定完成时间; 预先请求不对冲, 以免与连接自身的区间竞争
+        auto prepare = [&](State& state, Transfer& t, bool ahead) -> bool
+        {
+            t.range = {};
+            if (flag != kRunning || !(rf.allocate(t.range, state.index) ||
+                (config.openEnded && rf.split(t.range, config.blockSize)) ||
+                (!ahead && config.hedgeBytes > 0 && rf.hedge(t.range, config.hedgeBytes))))
+                return false;
+
+            // 数据经由原始的写回调直接填充至区间, 不在内存中缓存整个分块
+            t.ecode.clear();
+            t.sink.emplace(rf, t.range, flag, t.ecode);
+            t.session->set_range(t.range.start, config.openEnded ? -1 : t.range.end);
+            t.active = true;
+            t.done = false;
+            return true;
+        };
+
+        // 请求结束, 归还区间并处理错误, 返回 true 表示该连接可以继续下载下一个区间
+        auto complete = [&](State& state, Transfer& t) -> bool
         {
-            state.flag = State::kThreadRunning;
-            NLOG_APP("Worker start: {1}") % std::this_thread::get_id();
             util_scope_exit = [&] {
-                state.flag = state.error ? State::kThreadInterrupted 
-                                         : State::kThreadFinished;
-                NLOG_APP("Worker finished: {1}, flag: {2}, result: {3}")
-                    % std::this_thread::get_id()
-                    % flag.load()
-                    % state.error.message();
+                rf.deallocate(t.range);
+                t.sink.reset();
+                t.active = false;
             };
 
-            try 
+            auto& session = t.session;
+            if (state.meter.slow() && flag == kRunning)
             {
-                auto session = MakeSession(url, config.header);
+                NLOG_WAR("Slow connection, replace it, range: [{1}, {2}], position: {3}")
+                    % t.range.start
+                    % t.range.end
+                    % t.range.position;
+                renew(state, t);
+                state.meter.reset();
+                return true;
+            }
 
-                Range2 range;
-                while (flag == kRunning && rf.allocate(range))
+            if (t.code == CURLE_OK && session->status_code() == 200 && !session->accepted()) {
+                // 服务器忽略了范围请求, 继续下去只会重复的下载整个文件
+                NLOG_ERR("The server ignored the range request: ") << url;
+                state.error = util::MakeError(util::kServerError);
+                return false;
+            }
+
+            // 错误只反映最近的请求, 停滞或断开后重试成功的连接不再视为出错
+            state.error.clear();
+            if (HandleRequestError(session->status_code(), MakeRequestError(t.code, flag), t.ecode, flag, state.error)) {
+                NLOG_ERR("HandleRequestError() Fatal error, abort({1})") % state.error;
+                return false;
+            }
+            return true;
+        };
+
+        // 从 multi 句柄中移除传输, 未完成的部分归还, 已接收的数据保留在区间中
+        auto discard = [&](State& state, Transfer& t)
+        {
+            curl_multi_remove_handle(state.multi.get(), t.session->handle());
+            if (!t.done)
+                t.session->finish(CURLE_ABORTED_BY_CALLBACK);
+            rf.deallocate(t.range);
+            t.sink.reset();
+            t.active = false;
+        };
+
+        // 记录请求的等待时间及速度, 用于估计何时发起下一个请求
+        auto measure_request = [&](State& state, Transfer& t)
+        {
+            curl_off_t pretransfer = 0, starttransfer = 0, total = 0, size = 0;
+            auto handle = t.session->handle();
+            curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+            curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+            curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+            curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+            if (t.code != CURLE_OK || starttransfer <= pretransfer)
+                return;
+            state.latency = starttransfer - pretransfer;
+            state.rate = size * 1000000 / std::max<curl_off_t>(total - starttransfer, 1);
+            state.served = true;
+        };
+
+        // 当前区间剩余的传输时间不足一个请求的等待时间时, 应当发起下一个请求;
+        // 尚无估计时以当前请求的实时数据为准
+        auto ending = [&](State& state, Transfer& t) -> bool
+        {
+            int64_t latency = state.latency, rate = state.rate;
+            if (latency <= 0 || rate <= 0)
+            {
+                curl_off_t speed = 0, pretransfer = 0, starttransfer = 0;
+                auto handle = t.session->handle();
+                curl_easy_getinfo(handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+                curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+                curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+                if (speed <= 0 || starttransfer <= pretransfer)
+                    return false;
+                latency = starttransfer - pretransfer;
+                rate = speed;
+            }
+            auto remain = t.range.end + 1 - t.range.position;
+            return remain * 1000000 / rate <= latency;
+        };
+
+        // 下载区间. 预先请求模式下, 在其即将完成时为下一个区间发起请求, 请求的等待与当前的传输重叠,
+        // 预先请求的传输在本任务内接替, 不跨越排队; 下载终止时不等待区间传输完毕, 立即中止在途的传输.
+        // 线程池中有排队的任务时, 一个任务至多执行 kTaskSlice 即让出线程, 在途的区间在重新排队后继续,
+        // 以免少数连接各自占据线程直至区间完成, 其余连接的响应长时间无人接收; 让出时归还预先请求的区间
+        auto process = [&](State& state) -> bool
+        {
+            constexpr int kTaskSlice = 100;
+            auto multi = state.multi.get();
+            auto launch = [&](Transfer& t) {
+                curl_easy_setopt(t.session->handle(), CURLOPT_PRIVATE, &t);
+                t.session->begin(*t.sink);
+                curl_multi_add_handle(multi, t.session->handle());
+            };
+
+            auto slice = chr::steady_clock::now();
+            state.meter.resume();
+            util_scope_exit = [&] { state.meter.pause(); }; // 排队等待的时长不计入测速
+
+            while (true)
+            {
+                auto& current = state.transfers[state.current];
+                auto& ahead = state.transfers[state.current ^ 1];
+                if (!current.active)
                 {
-                    util_scope_exit = [&] {
-                        rf.deallocate(range);
-                    };
-
-                    std::error_code ecode;
-                    session->SetOption(cpr::Range{ range.start, range.end });
-
-#if 0
-                    //
-                    // 有的服务器可能会在下载过程中返回错误信息, 此时下载的内容并不是文件内容
-                    // 因此不能直接写入文件
-                    session->SetWriteCallback(cpr::WriteCallback{
-                        [&](const std::string& data, intptr_t userdata) -> bool
+                    if (!prepare(state, current, false))
+                        return false;
+                    launch(current);
+                    state.meter.begin();
+                }
+
+                while (!current.done)
+                {
+                    int running = 0, count = 0;
+                    curl_multi_perform(multi, &running);
+                    while (auto msg = curl_multi_info_read(multi, &count))
+                    {
+                        if (msg->msg != CURLMSG_DONE)
+                            continue;
+                        Transfer* t = nullptr;
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&t);
+                        t->code = t->session->finish(msg->data.result);
+                        t->done = true;
+                    }
+                    if (current.done)
+                        break;
+
+                    if (flag != kRunning)
+                    {
+                        NLOG_WAR("Download terminated, abort range: [{1}, {2}], position: {3}")
+                            % current.range.start
+                            % current.range.end
+                            % current.range.position;
+                        discard(state, current);
+                        if (ahead.active)
+                            discard(state, ahead);
+                        return false;
+                    }
+
+                    if (measure(slice) >= kTaskSlice)
+                    {
+                        if (ThreadPool::Instance().backlog())
                         {
-                            rf.fill(range, data, data.size(), ecode);
-                            return !ecode && flag == kRunning;
-                        } });
-#endif
-
-                    auto response = session->Get();
-                    if (response.status_code == 200 || response.status_code == 206)
-                        rf.fill(range, response.text, response.text.size(), ecode);
-
-                    if (HandleRequestError(response, ecode, flag, state.error)) {
-                        NLOG_ERR("HandleRequestError() Fatal error, abort({1})") % state.error;
-                        return;
+                            if (ahead.active)
+                                discard(state, ahead);
+                            return true;
+                        }
+                        slice = chr::steady_clock::now();
                     }
+
+                    if (config.requestAhead && !ahead.active && ending(state, current) && prepare(state, ahead, true))
+                        launch(ahead);
+                    curl_multi_poll(multi, nullptr, 0, 100, nullptr);
                 }
-                return;
+
+                curl_multi_remove_handle(multi, current.session->handle());
+                measure_request(state, current);
+                bool next = complete(state, current);
+                if (!ahead.active)
+                    return next;
+                if (!next)
+                {
+                    discard(state, ahead);
+                    return false;
+                }
+
+                // 由预先请求的传输接替, 其响应可能已经到达
+                state.current ^= 1;
+                state.meter.begin();
+            }
+        };
+
+        auto step = [&](State& state) -> bool
+        {
+            try 
+            {
+                return process(state);
             }
             catch (const std::exception& e) {
                 NLOG_ERR("Unhandled exception: ") << e.what();
@@ -495,15 +627,68 @@ bool DownloadFile(
                 NLOG_ERR("Unhandled exception");
             }
             state.error = util::MakeError(util::kRuntimeError);
+            return false;
         };
 
+        // 连接以任务链的形式在进程共享的线程池中执行: 每下载完一个区间 或 时间片用完, 后续的任务重新排队,
+        // 线程池因此在所有下载的连接之间轮转. 会话保存在连接状态中, 连接得以复用.
         std::vector<State> states(config.connections);
-        std::vector<std::shared_ptr<std::thread>> threads;
-        for (int i = 0; i < config.connections; ++i)
-            threads.push_back(std::make_shared<std::thread>(worker, std::ref(states[i])));
+        std::function<void(State&)> worker;
+        TaskGroup group;
+
+        worker = [&](State& state)
+        {
+            bool ready = true;
+            if (state.flag == State::kThreadNone)
+            {
+                state.flag = State::kThreadRunning;
+                NLOG_APP("Worker start: {1}") % std::this_thread::get_id();
+                try {
+                    renew(state, state.transfers[0]);
+                    if (config.requestAhead)
+                        renew(state, state.transfers[1]);
+                }
+                catch (const std::exception& e) {
+                    NLOG_ERR("Unhandled exception: ") << e.what();
+                    state.error = util::MakeError(util::kRuntimeError);
+                    ready = false;
+                }
+            }
 
+            if (ready && step(state)) {
+                group.run([&, s = &state] { worker(*s); });
+                return;
+            }
+
+            monitor.clear(state.index);
+            state.flag = state.error ? State::kThreadInterrupted 
+                                     : State::kThreadFinished;
+            NLOG_APP("Worker finished: {1}, flag: {2}, result: {3}")
+                % std::this_thread::get_id()
+                % flag.load()
+                % state.error.message();
+        };
+
+        // multi 句柄在任务链开始之前创建, 监视线程唤醒时无需与连接同步
+        for (auto& state : states)
+        {
+            state.multi.reset(curl_multi_init(), curl_multi_cleanup);
+            if (!state.multi)
+                throw std::runtime_error("curl_multi_init() failed");
+        }
+
+        for (auto& state : states)
+        {
+            state.index = int(&state - states.data());
+            state.meter = SpeedMeter(monitor, state.index);
+            group.run([&, s = &state] { worker(*s); });
+        }
+
+        auto transferStart = chr::steady_clock::now();
+        auto transferBytes = rf.processed();
         auto lastIndex = 0;
         auto lastDump = chr::steady_clock::now();
+        auto lastDumpBytes = rf.processed();
         while (flag.load() == kRunning && !rf.is_full())
         {
             // 在下载阶段的尾声, 部分线程开始陆续退出, 此时不会设置错误
@@ -525,7 +710,8 @@ bool DownloadFile(
                     {
                         std::pair<int, int> item;
                         for (auto p : counts)
-                            item = item.second > p.second ? item : p;
+                            if (p.second > item.second)
+                                item = p;
                         NLOG_ERR("download_file({1}, {2}) failed, error: {3}, count: {4}")
                             % url
                             % filename.wstring()
@@ -551,20 +737,66 @@ bool DownloadFile(
                 }
             }
 
-            // 限制存储下载状态的频率
-            if (measure(lastDump) >= 5000)
+            // 按时间或下载量批量的保存下载状态, 数据同步的开销由两次检查点之间的所有写入分摊
+            auto processed = rf.processed();
+            if (measure(lastDump) >= config.checkpointInterval ||
+                (config.checkpointBytes > 0 && processed - lastDumpBytes >= config.checkpointBytes))
             {
                 std::error_code ecode;
                 if (!rf.dump(ecode))
                     NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
                 lastDump = chr::steady_clock::now();
+                lastDumpBytes = processed;
             }
 
             std::this_thread::sleep_for(chr::milliseconds(config.interval));
         }
 
-        for (auto t : threads)
-            t->join();
+        // 已经结束时, 排队中的任务无需再执行, 正在等待数据的连接立即醒来中止传输
+        if (flag.load() != kRunning)
+        {
+            group.cancel();
+            for (auto& state : states)
+                curl_multi_wakeup(state.multi.get());
+        }
+        group.wait();
+
+        // 被取消的任务链可能遗留预先请求的传输, 归还其区间
+        for (auto& state : states)
+        {
+            for (auto& t : state.transfers)
+                if (t.active)
+                    discard(state, t);
+        }
+
+        // 未完成时保存最后的进度, 以便下次续传
+        if (error)
+        {
+            std::error_code ecode;
+            if (!rf.dump(ecode))
+                NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+        }
+        else if (origins.enabled())
+        {
+            // 始终没有完成请求 而又出错的连接视为被源站拒绝
+            int useful = 0, refused = 0, samples = 0;
+            int64_t rate = 0, latency = 0;
+            for (auto& state : states)
+            {
+                useful += state.served;
+                refused += !state.served && state.error;
+                if (state.rate > 0 && state.latency > 0) {
+                    rate += state.rate;
+                    latency += state.latency;
+                    samples++;
+                }
+            }
+
+            auto elapse = measure(transferStart);
+            auto throughput = elapse >= 100 ? (rf.processed() - transferBytes) * 1000 / elapse : 0;
+            origins.record_transfer(url, config.connections, refused > 0 ? std::max(useful, 1) : 0,
+                throughput, samples ? rate / samples : 0, samples ? latency / samples : 0);
+        }
     }
     catch (const std::exception& e)
     {
@@ -575,6 +807,113 @@ bool DownloadFile(
     return !error;
 }
 
+bool DownloadFile(
+    const std::string& url,
+    const std::filesystem::path& filename,
+    const std::function<bool(const download_status&)>& callback,
+    const download_preference config,
+    std::error_code& error
+    )
+{
+    if (config.discard)
+        return PerformDownload(url, filename, std::make_shared<NullStorage>(), callback, config, error);
+
+    // 相同的并发下载合并为一次传输, 相同的目标文件同时只属于一次传输
+    auto& flights = SingleFlight::Instance();
+    auto key = SingleFlight::Key(url, config.header);
+    while (true)
+    {
+        error.clear();
+        std::shared_ptr<SingleFlight::Flight> flight;
+        auto role = flights.join(key, filename, flight);
+        if (role == SingleFlight::kLeader)
+        {
+            auto report = [&](const download_status& status) {
+                flight->total = status.totalBytes;
+                flight->processed = status.processedBytes;
+                return !callback || callback(status);
+            };
+            PerformDownload(url, filename, nullptr, report, config, error);
+            flights.finish(flight, error);
+            return !error;
+        }
+
+        NLOG_PRO("DownloadFile() waiting for {1} transfer of the same {2}, File: {3}")
+            % (role == SingleFlight::kFollower ? "the ongoing" : "another")
+            % (role == SingleFlight::kFollower ? "url" : "file")
+            % filename;
+
+        // 等待期间以发起者的进度回调
+        while (!flight->wait_for(std::max(config.interval, 10)))
+        {
+            download_status status = { 0, 0 };
+            if (role == SingleFlight::kFollower)
+                status = { flight->total, flight->processed };
+            if (callback && !callback(status))
+            {
+                NLOG_WAR("callback() instructing to terminate a task...");
+                if (role == SingleFlight::kFollower)
+                    flights.leave(flight, filename);
+                error = util::MakeError(util::kOperationInterrupted);
+                return false;
+            }
+        }
+
+        // 目标文件已释放, 重新加入
+        if (role == SingleFlight::kConflict)
+            continue;
+
+        // 发起者取消了下载, 由仍在等待的调用者接替, 从保存的进度续传
+        error = flight->result(filename);
+        if (error == util::MakeError(util::kOperationInterrupted))
+            continue;
+
+        NLOG_PRO("DownloadFile() joined transfer finished, result: {1}") % error.message();
+        return !error;
+    }
+}
+
+void SetDownloadGlobalOptions(const download_global_options& options)
+{
+    NLOG_PRO("SetDownloadGlobalOptions() threads: {1}, pinned: {2}, memory-budget: {3}, receive-buffer: {4}, origin-cache: {5}")
+        % options.threads
+        % (options.pinned ? "true" : "false")
+        % options.memoryBudget
+        % options.receiveBuffer
+        % options.originCache.wstring();
+
+    std::lock_guard<std::mutex> locker(GlobalOptionsMutex());
+    GlobalOptions() = options;
+    ThreadPool::Instance().configure(options.threads, options.pinned);
+    ReceiveBudget::Instance().configure(options.memoryBudget, options.receiveBuffer);
+    OriginCache::Instance().configure(options.originCache);
+}
+
+download_global_options GetDownloadGlobalOptions()
+{
+    std::lock_guard<std::mutex> locker(GlobalOptionsMutex());
+    return GlobalOptions();
+}
+
+bool DownloadToBuffer(
+    const std::string& url,
+    std::vector<char>& data,
+    const std::function<bool(const download_status&)>& callback,
+    const download_preference config,
+    std::error_code& error
+    )
+{
+    auto storage = std::make_shared<MemoryStorage>();
+    if (PerformDownload(url, "memory", storage, callback, config, error))
+        data = storage->take();
+    return !error;
+}
+
+std::string GetDownloadMetrics()
+{
+    return Metrics::Instance().expose();
+}
+
 int RequestContent(
     const std::string& url,
     std::map<std::string, std::string> header,
@@ -586,6 +925,7 @@ int RequestContent(
     {
         auto session1 = MakeSession(url, header);
         session1->SetConnectTimeout(8000);
+        Metrics::Instance().requests.add();
         auto response = session1->Get();
 
         if (response.status_code == 200)
@@ -0,0 +1,1104 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+
+#include "nlog.h"
+#include "range_file.hpp"
+#include "range_policy.hpp"
+#include "curl_session.hpp"
+#include "http_header.hpp"
+#include "request_error.hpp"
+#include "speed_monitor.hpp"
+#include "thread_pool.hpp"
+#include "downloader_asio.h"
+
+#include "common/scope.hpp"
+#include "common/assert.hpp"
+
+namespace asio = boost::asio;
+namespace chr = std::chrono;
+
+//
+// 基于 io_context 的异步下载
+//
+// 1. 套接字由 asio 打开(CURLOPT_OPENSOCKETFUNCTION), libcurl 通过 CURLMOPT_SOCKETFUNCTION 告知关心的事件,
+//    由 async_wait 等待就绪后调用 curl_multi_socket_action(), 超时由 steady_timer 驱动.
+// 1. 所有的处理均在同一个 strand 上执行, libcurl 的回调也只会在 strand 上发生, 因此无需加锁.
+// 1. 下载流程与 DownloadFile() 一致: 探测文件属性, 然后单点下载 或 多个连接分块下载.
+//    多点下载时每个连接完成一个区间后, 复用同一个 easy 句柄(及其连接)继续下一个区间.
+// 1. 预先请求时每个连接有两组会话交替使用, 区间即将完成时由另一组为下一个区间发起请求,
+//    当前的会话完成后退居备用, 其连接留在 multi 句柄的连接池中供之后的请求复用.
+//
+class AsyncDownload : public std::enable_shared_from_this<AsyncDownload>
+{
+    using tcp = asio::ip::tcp;
+
+    struct Socket {
+        tcp::socket socket;
+        int  action  = CURL_POLL_NONE; // libcurl 关心的事件
+        bool reading = false;
+        bool writing = false;
+        bool pending = false; // 已排队尝试处理
+        bool closed  = false;
+
+        explicit Socket(asio::io_context& context) : socket(context) {}
+    };
+
+    struct Connection {
+        std::unique_ptr<CurlSession> session;
+        std::unique_ptr<BodySink>    sink;
+        SpeedMeter                   meter;
+        Range2                       range;
+        int                          index   = 0;
+        std::error_code              fserr;
+        std::error_code              error;
+        bool                         busy    = false;
+        bool                         stopped = false;
+        Connection*                  twin    = nullptr;  // 预先请求时交替使用的另一组会话
+        bool                         ahead   = false;    // 已为下一个区间发起(或尝试发起)请求
+        int64_t                      latency = 0;        // 最近一次请求的等待时间(微秒)
+        int64_t                      rate    = 0;        // 最近一次请求收到首字节之后的速度(字节/秒)
+    };
+
+    asio::io_context&                                _context;
+    asio::strand<asio::io_context::executor_type>    _strand;
+    asio::steady_timer                               _timer;  // libcurl 的超时
+    asio::steady_timer                               _ticker; // 状态汇报及检查点
+    CURLM*                                           _multi = nullptr;
+    std::map<curl_socket_t, std::shared_ptr<Socket>> _sockets;
+
+    std::string                                      _url;
+    std::filesystem::path                            _filename;
+    std::function<bool(const download_status&)>     _callback;
+    download_preference                              _config;
+    std::function<void(const std::error_code&)>      _handler;
+
+    std::atomic_int                                  _flag = kRunning;
+    bool                                             _done = false;
+    bool                                             _dumping = false; // 持久的检查点正在线程池中执行
+    bool                                             _closing = false; // 已结束, 等待检查点完成后关闭文件
+    std::error_code                                  _result;
+    bool                                             _multipoint = false;
+    chr::steady_clock::time_point                    _start;
+    chr::steady_clock::time_point                    _lastDump;
+    int64_t                                          _lastDumpBytes = 0;
+
+    RangeFile                                        _rf;
+    file_attribute                                   _attribute;
+    file_attribute                                   _response;      // 单点下载最近一次请求的响应头
+    int64_t                                          _offset = 0;    // 单点下载最近一次请求的起始位置
+    bool                                             _ranges = false; // 单点下载时服务器支持范围请求
+    CURL*                                            _probe = nullptr;
+    curl_slist*                                      _probeHeader = nullptr;
+    std::vector<std::unique_ptr<Connection>>         _connections;
+    std::unique_ptr<SpeedMonitor>                    _monitor;
+
+    // 连接由 asio 打开, 以便在 context 上等待套接字就绪
+    void bind(CURL* curl)
+    {
+        curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, OpenSocketCallback);
+        curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, this);
+        curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, CloseSocketCallback);
+        curl_easy_setopt(curl, CURLOPT_CLOSESOCKETDATA, this);
+    }
+
+    int measure(chr::steady_clock::time_point start) const {
+        return (int)chr::duration_cast<chr::milliseconds>(chr::steady_clock::now() - start).count();
+    }
+
+    static curl_socket_t OpenSocketCallback(void* clientp, curlsocktype purpose, curl_sockaddr* address)
+    {
+        auto self = static_cast<AsyncDownload*>(clientp);
+        if (purpose != CURLSOCKTYPE_IPCXN || address->socktype != SOCK_STREAM ||
+            (address->family != AF_INET && address->family != AF_INET6))
+            return CURL_SOCKET_BAD;
+
+        auto sock = std::make_shared<Socket>(self->_context);
+        boost::system::error_code ecode;
+        sock->socket.open(address->family == AF_INET ? tcp::v4() : tcp::v6(), ecode);
+        if (ecode) {
+            NLOG_ERR("AsyncDownload open socket failed, error: ") << ecode.message();
+            return CURL_SOCKET_BAD;
+        }
+
+        auto fd = sock->socket.native_handle();
+        self->_sockets[fd] = sock;
+        return fd;
+    }
+
+    static int CloseSocketCallback(void* clientp, curl_socket_t item)
+    {
+        auto self = static_cast<AsyncDownload*>(clientp);
+        auto it = self->_sockets.find(item);
+        if (it == self->_sockets.end())
+        {
+#ifdef _WIN32
+            return closesocket(item);
+#else
+            return ::close(item);
+#endif
+        }
+
+        // 关闭会以 operation_aborted 结束尚在等待的 async_wait
+        boost::system::error_code ecode;
+        it->second->closed = true;
+        it->second->socket.close(ecode);
+        self->_sockets.erase(it);
+        return 0;
+    }
+
+    static int SocketCallback(CURL*, curl_socket_t s, int what, void* userp, void*)
+    {
+        auto self = static_cast<AsyncDownload*>(userp);
+        auto it = self->_sockets.find(s);
+        if (it == self->_sockets.end() || self->_done)
+            return 0;
+
+        it->second->action = (what == CURL_POLL_REMOVE) ? CURL_POLL_NONE : what;
+        self->watch(it->second, s);
+        return 0;
+    }
+
+    static int TimerCallback(CURLM*, long timeout, void* userp)
+    {
+        auto self = static_cast<AsyncDownload*>(userp);
+        self->_timer.cancel();
+        if (timeout < 0 || self->_done)
+            return 0;
+
+        // 不能在回调内调用 curl_multi_socket_action(), 即使超时为 0 也要经由定时器
+        self->_timer.expires_after(chr::milliseconds(timeout));
+        self->_timer.async_wait(asio::bind_executor(self->_strand,
+            [self = self->shared_from_this()](const boost::system::error_code& ecode) {
+                if (ecode || self->_multi == nullptr)
+                    return;
+                int running = 0;
+                curl_multi_socket_action(self->_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+                self->check_info();
+            }));
+        return 0;
+    }
+
+    void watch(const std::shared_ptr<Socket>& sock, curl_socket_t s)
+    {
+        if ((sock->action & CURL_POLL_IN) && !sock->reading)
+        {
+            sock->reading = true;
+            sock->socket.async_wait(tcp::socket::wait_read, asio::bind_executor(_strand,
+                [self = shared_from_this(), sock, s](const boost::system::error_code& ecode) {
+                    sock->reading = false;
+                    self->on_socket(sock, s, ecode, CURL_CSELECT_IN);
+                }));
+        }
+
+        // asio 的 epoll 反应器是边沿触发的, 开始等待之前的就绪状态不会再通知:
+        //  - 已到达(或 libcurl 没有读尽)的数据, 在开始等待之后检查一次
+        //  - 连接复用时套接字早已可写, 不会再有可写的通知, 因此开始等待时先尝试一次
+        // 两者均经由 strand 排队处理, 其他的处理程序得以穿插执行, 多余的尝试对 libcurl 无害
+        bool kick = false;
+        if ((sock->action & CURL_POLL_OUT) && !sock->writing)
+        {
+            kick = true;
+            sock->writing = true;
+            sock->socket.async_wait(tcp::socket::wait_write, asio::bind_executor(_strand,
+                [self = shared_from_this(), sock, s](const boost::system::error_code& ecode) {
+                    sock->writing = false;
+                    self->on_socket(sock, s, ecode, CURL_CSELECT_OUT);
+                }));
+        }
+
+        if ((sock->action & CURL_POLL_IN) && !kick)
+        {
+            boost::system::error_code error;
+            kick = sock->socket.available(error) > 0 && !error;
+        }
+
+        if (kick && !sock->pending)
+        {
+            sock->pending = true;
+            asio::post(_strand, [self = shared_from_this(), sock, s] {
+                sock->pending = false;
+                self->on_socket(sock, s, {}, CURL_CSELECT_IN | CURL_CSELECT_OUT);
+            });
+        }
+    }
+
+    void on_socket(const std::shared_ptr<Socket>& sock, curl_socket_t s, const boost::system::error_code& ecode, int event)
+    {
+        if (_multi == nullptr || sock->closed || ecode == asio::error::operation_aborted)
+            return;
+
+        // 等待期间 libcurl 可能已不再关心该事件
+        int mask = 0;
+        if ((event & CURL_CSELECT_IN) && (sock->action & CURL_POLL_IN))
+            mask |= CURL_CSELECT_IN;
+        if ((event & CURL_CSELECT_OUT) && (sock->action & CURL_POLL_OUT))
+            mask |= CURL_CSELECT_OUT;
+
+        if (mask != 0)
+        {
+            int running = 0;
+            curl_multi_socket_action(_multi, s, ecode ? CURL_CSELECT_ERR : mask, &running);
+            check_info();
+        }
+
+        if (_multi && !sock->closed)
+            watch(sock, s);
+    }
+
+    void check_info()
+    {
+        int pending = 0;
+        while (_multi)
+        {
+            CURLMsg* msg = curl_multi_info_read(_multi, &pending);
+            if (msg == nullptr)
+                break;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            CURL* easy = msg->easy_handle;
+            CURLcode code = msg->data.result;
+            curl_multi_remove_handle(_multi, easy);
+
+            if (easy == _probe)
+                on_probe(code);
+            else
+            {
+                Connection* conn = nullptr;
+                curl_easy_getinfo(easy, CURLINFO_PRIVATE, &conn);
+                util_assert(conn);
+                conn->busy = false;
+                if (_multipoint)
+                    on_range(*conn, code);
+                else
+                    on_direct(*conn, code);
+            }
+        }
+    }
+
+    void probe(int timeout)
+    {
+        if (_probe == nullptr)
+        {
+            _probe = curl_easy_init();
+            if (_probe == nullptr)
+                return finish(util::MakeError(util::kRuntimeError));
+        }
+
+        curl_slist_free_all(_probeHeader);
+        _probeHeader = CurlSetOptions(_probe, _url, _config.header, timeout);
+        curl_easy_setopt(_probe, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(_probe, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(_probe, CURLOPT_HEADERFUNCTION, WriteHeadCallback);
+        curl_easy_setopt(_probe, CURLOPT_HEADERDATA, &_attribute);
+        curl_easy_setopt(_probe, CURLOPT_RANGE, "0-");
+        bind(_probe);
+
+        _attribute = {};
+        curl_multi_add_handle(_multi, _probe);
+    }
+
+    void on_probe(CURLcode code)
+    {
+        std::error_code error;
+        if (!HandleProbeResult(_probe, code, _attribute, error))
+        {
+            // 与 DownloadFile() 相同, 网络错误在超时之前重试
+            if (error.value() == util::kNetworkError)
+            {
+                auto elapse = measure(_start);
+                if (elapse < _config.timeout)
+                {
+                    auto timeout = std::max(_config.timeout - elapse, 500);
+                    NLOG_PRO("keep trying, timeout: {1} ...") % timeout;
+                    return probe(timeout);
+                }
+            }
+
+            NLOG_ERR("AsyncDownload failed, error: ") << error.message();
+            return finish(error);
+        }
+
+        NLOG_PRO("GetFileAttribute() -> {1}\r\n{2}")
+            % _attribute.contentLength
+            % _attribute.header;
+        download();
+    }
+
+    void download()
+    {
+        try
+        {
+            start_download();
+        }
+        catch (const std::exception& e)
+        {
+            NLOG_ERR("Unhandled exception: ") << e.what();
+            finish(util::MakeError(util::kRuntimeError));
+        }
+    }
+
+    void start_download()
+    {
+        util::ferror ferr;
+        if (!_config.discard && util::file_exist(_filename, ferr))
+            util::file_remove(_filename, ferr);
+        if (ferr) {
+            NLOG_ERR("util::file_*() failed, error: ") << ferr.message();
+            return finish(util::MakeErrorFromNative(ferr.code(), _filename, util::kFilesystemError));
+        }
+
+        std::error_code error;
+        _multipoint = !(_attribute.contentLength == -1 ||
+                        _attribute.contentLength <= _config.blockSize ||
+                        !SupportRanges(_attribute));
+        if (!_multipoint)
+        {
+            NLOG_PRO("Direct download ...");
+
+            // 未知大小 or 长度太短 or 不支持范围请求, 只能单点下载
+            _rf.reserve(_attribute.contentLength);
+            if (_config.discard)
+                _rf.set_storage(std::make_shared<NullStorage>());
+            _rf.set_durable(_config.durable);
+            _rf.set_stream(true);
+            if (!_rf.open(_filename, error))
+                return finish(error);
+
+            _ranges = SupportRanges(_attribute);
+            _lastDump = chr::steady_clock::now();
+            _lastDumpBytes = _rf.processed();
+
+            auto conn = std::make_unique<Connection>();
+            conn->session = std::make_unique<CurlSession>(_url, _config.header);
+            conn->session->set_connect_timeout(_config.timeout);
+            conn->session->set_stall_timeout(_config.stallBytes, _config.stallWindow, _config.idleTimeout);
+            conn->session->set_response_header(&_response);
+            bind(conn->session->handle());
+            conn->session->set_progress(
+                [this](int64_t downloadTotal, int64_t downloadNow) -> bool
+                {
+                    // downloadTotal 很可能为0
+                    auto processed = _rf.processed();
+                    auto total = _attribute.contentLength > 0 ? _attribute.contentLength :
+                                 downloadTotal > 0 ? _offset + downloadTotal : 0;
+                    if (_callback && !_callback({ total, processed })) {
+                        _flag = kCancelled;
+                        return false;
+                    }
+
+                    // 按时间或下载量批量的保存进度, 长时间的单点下载在重启后可以续传
+                    if (measure(_lastDump) >= _config.checkpointInterval ||
+                        (_config.checkpointBytes > 0 && processed - _lastDumpBytes >= _config.checkpointBytes))
+                        checkpoint();
+                    return true;
+                });
+            _connections.push_back(std::move(conn));
+            launch_direct(*_connections.back());
+            return;
+        }
+
+        NLOG_PRO("Multipoint download ...");
+
+        _rf.reserve(_attribute.contentLength, _config.blockSize);
+        if (_config.discard)
+            _rf.set_storage(std::make_shared<NullStorage>());
+        _rf.set_durable(_config.durable);
+        _rf.set_open_ended(_config.openEnded);
+        _rf.set_policy(MakeRangePolicy(_config.allocation), _config.connections);
+        if (!_rf.open(_filename, error))
+            return finish(error);
+
+        _monitor = std::make_unique<SpeedMonitor>(_config.connections, _config.slowRatio, _config.slowWindow);
+        for (int i = 0; i < _config.connections; ++i)
+        {
+            auto conn = std::make_unique<Connection>();
+            conn->index = i;
+            conn->meter = SpeedMeter(*_monitor, i);
+            connect(*conn);
+            _connections.push_back(std::move(conn));
+        }
+        for (auto& conn : _connections)
+            launch(*conn);
+
+        _lastDump = chr::steady_clock::now();
+        _lastDumpBytes = _rf.processed();
+        tick();
+    }
+
+    // 为多点下载的连接创建会话, 测速, 对冲的胜负 及 预先请求的时机由进度回调驱动
+    void connect(Connection& conn)
+    {
+        conn.session = std::make_unique<CurlSession>(_url, _config.header);
+        conn.session->set_stall_timeout(_config.stallBytes, _config.stallWindow, _config.idleTimeout);
+        bind(conn.session->handle());
+        if (_monitor->enabled() || _config.hedgeBytes > 0 || _config.requestAhead) {
+            conn.session->set_progress([this, &conn](int64_t, int64_t now) {
+                if (_rf.superseded(conn.range)) // 对端已先完成, 即使没有数据到达也尽快中止
+                    return false;
+                if (_config.requestAhead && !conn.ahead && !_done && ending(conn)) {
+                    // 回调中不能操作 multi 句柄, 排队处理
+                    conn.ahead = true;
+                    asio::post(_strand, [self = shared_from_this(), c = &conn] { self->request_ahead(*c); });
+                }
+                return !_monitor->enabled() || conn.meter.update(now);
+            });
+        }
+    }
+
+    // 当前区间剩余的传输时间不足一个请求的等待时间时, 应当发起下一个请求;
+    // 尚无估计时以当前请求的实时数据为准
+    bool ending(Connection& conn)
+    {
+        int64_t latency = conn.latency, rate = conn.rate;
+        if (latency <= 0 || rate <= 0)
+        {
+            curl_off_t speed = 0, pretransfer = 0, starttransfer = 0;
+            auto handle = conn.session->handle();
+            curl_easy_getinfo(handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+            curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+            curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+            if (speed <= 0 || starttransfer <= pretransfer)
+                return false;
+            latency = starttransfer - pretransfer;
+            rate = speed;
+        }
+        auto remain = conn.range.end + 1 - conn.range.position;
+        return remain * 1000000 / rate <= latency;
+    }
+
+    // 记录请求的等待时间及速度, 用于估计何时发起下一个请求
+    void measure_request(Connection& conn, CURLcode code)
+    {
+        curl_off_t pretransfer = 0, starttransfer = 0, total = 0, size = 0;
+        auto handle = conn.session->handle();
+        curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+        if (code != CURLE_OK || starttransfer <= pretransfer)
+            return;
+        conn.latency = starttransfer - pretransfer;
+        conn.rate = size * 1000000 / std::max<curl_off_t>(total - starttransfer, 1);
+    }
+
+    // 预先请求: 由另一组会话为下一个区间发起请求, 当前的区间完成后由其接替
+    void request_ahead(Connection& conn)
+    {
+        if (_done || !conn.busy || _flag != kRunning)
+            return;
+
+        if (conn.twin == nullptr)
+        {
+            auto twin = std::make_unique<Connection>();
+            twin->index = conn.index;
+            twin->meter = SpeedMeter(*_monitor, conn.index);
+            twin->twin = &conn;
+            twin->stopped = true;
+            connect(*twin);
+            conn.twin = twin.get();
+            _connections.push_back(std::move(twin));
+        }
+
+        auto& next = *conn.twin;
+        if (next.busy)
+            return;
+        next.latency = conn.latency;
+        next.rate = conn.rate;
+        launch(next, true);
+    }
+
+    // 为连接分配下一个区间并加入 multi 句柄, 没有可分配, 可拆分 或 可对冲的区间时连接结束;
+    // 预先请求不对冲, 以免与连接自身的区间竞争
+    void launch(Connection& conn, bool ahead = false)
+    {
+        if (_multipoint)
+        {
+            if (_flag != kRunning || !(_rf.allocate(conn.range, conn.index) ||
+                (_config.openEnded && _rf.split(conn.range, _config.blockSize)) ||
+                (!ahead && _config.hedgeBytes > 0 && _rf.hedge(conn.range, _config.hedgeBytes)))) {
+                conn.stopped = true;
+                return;
+            }
+
+            conn.stopped = false;
+            conn.ahead = false;
+            conn.fserr.clear();
+            conn.sink = std::make_unique<RangeSink>(_rf, conn.range, _flag, conn.fserr);
+            conn.meter.begin();
+            conn.session->set_range(conn.range.start, _config.openEnded ? -1 : conn.range.end);
+        }
+
+        auto handle = conn.session->handle();
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, &conn);
+        conn.session->begin(*conn.sink);
+        conn.busy = true;
+        curl_multi_add_handle(_multi, handle);
+    }
+
+    // 单点下载: 已写入部分数据时从其末尾续传, 存在校验符时附加 If-Range,
+    // 内容已改变 或 服务器不支持范围请求时将返回整个文件
+    void launch_direct(Connection& conn)
+    {
+        if (_rf.is_full())
+            return finish({});
+
+        _offset = _rf.processed();
+        auto header = _config.header;
+        if (_offset > 0 && (_ranges || !_rf.validator().empty()))
+        {
+            if (!_rf.validator().empty())
+                header["If-Range"] = _rf.validator();
+            conn.session->set_range(_offset);
+            NLOG_PRO("Resume the direct download, offset: {1}, validator: {2}")
+                % _offset
+                % _rf.validator();
+        }
+        else
+        {
+            _offset = 0;
+            conn.session->set_range(-1);
+            std::error_code error;
+            if (_rf.processed() > 0 && !_rf.rewind(error))
+                return finish(error);
+        }
+        conn.session->set_header(header);
+
+        conn.fserr.clear();
+        conn.sink = std::make_unique<StreamSink>(_rf, conn.fserr, _offset, &_response);
+        launch(conn);
+    }
+
+    void on_direct(Connection& conn, CURLcode code)
+    {
+        auto& session = *conn.session;
+        code = session.finish(code);
+        _ranges = _ranges || SupportRanges(_response) || session.status_code() == 206;
+
+        // 续传的位置恰好是文件的末尾(未知长度时无法预先判断)
+        int64_t first, last, total;
+        if (code == CURLE_OK && session.status_code() == 416 && _offset > 0 &&
+            ParseContentRange(_response.contentRange, first, last, total) && total == _offset)
+            return finish({});
+
+        std::error_code error;
+        if (HandleRequestError(session.status_code(), MakeRequestError(code, _flag), conn.fserr, _flag, error))
+            return finish(error); // 致命错误, 直接终止
+
+        if (error.value() == util::kNetworkError)
+        {
+            auto elapse = measure(_start);
+            if (elapse < _config.timeout)
+            {
+                auto timeout = std::max(_config.timeout - elapse, 1000);
+                session.set_connect_timeout(timeout);
+
+                NLOG_PRO("keep trying, timeout: {1} ...") % timeout;
+                return launch_direct(conn);
+            }
+        }
+
+        if (error)
+        {
+            NLOG_ERR("Direct download failed, status code: {1}, error: {2}")
+                % session.status_code()
+                % error.message();
+        }
+        else
+        {
+            NLOG_PRO("Direct download finished, status code: {1}")
+                % session.status_code();
+        }
+        finish(error);
+    }
+
+    void on_range(Connection& conn, CURLcode code)
+    {
+        auto& session = *conn.session;
+        code = session.finish(code);
+        _rf.deallocate(conn.range);
+        measure_request(conn, code);
+        conn.meter.pause();
+
+        // 已由另一组会话预先请求了下一个区间, 由其接替, 本组退居备用
+        bool handoff = conn.ahead && conn.twin && conn.twin->busy;
+
+        // 持续明显慢于其他连接, 未完成的部分已经归还, 换一个新的连接
+        if (conn.meter.slow() && _flag == kRunning)
+        {
+            NLOG_WAR("Slow connection, replace it, range: [{1}, {2}], position: {3}")
+                % conn.range.start
+                % conn.range.end
+                % conn.range.position;
+            connect(conn);
+            conn.meter.reset();
+            if (handoff) {
+                conn.stopped = true;
+                return;
+            }
+            return launch(conn);
+        }
+
+        // 错误只反映最近的请求, 停滞或断开后重试成功的连接不再视为出错
+        conn.error.clear();
+        bool fatal = false;
+        if (code == CURLE_OK && session.status_code() == 200 && !session.accepted()) {
+            // 服务器忽略了范围请求, 继续下去只会重复的下载整个文件
+            NLOG_ERR("The server ignored the range request: ") << _url;
+            conn.error = util::MakeError(util::kServerError);
+            fatal = true;
+        }
+        else if (HandleRequestError(session.status_code(), MakeRequestError(code, _flag), conn.fserr, _flag, conn.error)) {
+            NLOG_ERR("HandleRequestError() Fatal error, abort({1})") % conn.error;
+            fatal = true;
+        }
+
+        if (_rf.is_full())
+            return finish({});
+
+        if (fatal || handoff)
+            conn.stopped = true;
+        else
+            launch(conn);
+        if (conn.stopped && !handoff)
+            _monitor->clear(conn.index);
+
+        // 所有连接均已结束, 但文件仍未完成
+        bool stopped = std::all_of(_connections.begin(), _connections.end(),
+            [](const auto& c) { return c->stopped; });
+        if (stopped)
+            finish(common_error());
+    }
+
+    // 出现次数最多的连接错误
+    std::error_code common_error() const
+    {
+        std::map<int, int> counts;
+        for (auto& conn : _connections)
+            counts[conn->error.value()]++;
+
+        std::pair<int, int> item;
+        for (auto p : counts)
+            if (p.second > item.second)
+                item = p;
+        return util::MakeError(item.first == util::kSucceed ? util::kRuntimeError : item.first);
+    }
+
+    void tick()
+    {
+        if (_done)
+            return;
+
+        if (_callback && !_callback({ _attribute.contentLength, _rf.processed() }))
+        {
+            NLOG_WAR("callback() instructing to terminate a task...");
+            _flag = kCancelled;
+            return finish(util::MakeError(util::kOperationInterrupted));
+        }
+
+        if (measure(_start) > _config.timeout)
+        {
+            bool failed = std::all_of(_connections.begin(), _connections.end(),
+                [](const auto& c) { return (bool)c->error; });
+            if (failed) // 所有连接均出错
+            {
+                auto error = common_error();
+                NLOG_ERR("download_file({1}, {2}) failed, error: {3}")
+                    % _url
+                    % _filename.wstring()
+                    % error.value();
+                return finish(error);
+            }
+        }
+
+        // 按时间或下载量批量的保存下载状态
+        auto processed = _rf.processed();
+        if (measure(_lastDump) >= _config.checkpointInterval ||
+            (_config.checkpointBytes > 0 && processed - _lastDumpBytes >= _config.checkpointBytes))
+            checkpoint();
+
+        _ticker.expires_after(chr::milliseconds(_config.interval));
+        _ticker.async_wait(asio::bind_executor(_strand,
+            [self = shared_from_this()](const boost::system::error_code& ecode) {
+                if (!ecode)
+                    self->tick();
+            }));
+    }
+
+    // 保存下载状态. 持久模式的检查点须同步数据文件, 可能耗时数百毫秒,
+    // 因此在共享的线程池中执行, 完成后回到 strand; 同一时刻至多一个检查点在途.
+    // 执行期间持有 context 的 work, 以免 context 因暂时没有 I/O 而提前返回
+    void checkpoint()
+    {
+        _lastDump = chr::steady_clock::now();
+        _lastDumpBytes = _rf.processed();
+
+        if (!_config.durable)
+        {
+            std::error_code ecode;
+            if (!_rf.dump(ecode))
+                NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+            return;
+        }
+
+        if (_dumping)
+            return;
+        _dumping = true;
+        ThreadPool::Instance().post(nullptr, [self = shared_from_this(), work = asio::make_work_guard(_context)]
+        {
+            std::error_code ecode;
+            if (!self->_rf.dump(ecode))
+                NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+
+            asio::post(self->_strand, [self] {
+                self->_dumping = false;
+                if (self->_closing) // 结束时等待检查点完成才能关闭文件
+                    self->close_async();
+            });
+        });
+    }
+
+    void finish(std::error_code error)
+    {
+        if (_done)
+            return;
+        _done = true;
+
+        if (error && _flag == kRunning)
+            _flag = kFailed;
+
+        _timer.cancel();
+        _ticker.cancel();
+
+        abort();
+        _result = error;
+        if (!_config.durable)
+        {
+            close_file(_result);
+            complete();
+            return;
+        }
+
+        // 持久模式下关闭文件同样需要同步, 在线程池中执行
+        _closing = true;
+        if (!_dumping)
+            close_async();
+    }
+
+    void close_async()
+    {
+        _closing = false;
+        ThreadPool::Instance().post(nullptr, [self = shared_from_this(), work = asio::make_work_guard(_context)]
+        {
+            self->close_file(self->_result);
+            asio::post(self->_strand, [self] { self->complete(); });
+        });
+    }
+
+    void complete()
+    {
+        release();
+
+        NLOG_PRO("AsyncDownload() finished, result: {1}") % _result.message();
+        asio::post(_strand, [self = shared_from_this()] {
+            if (self->_handler)
+                self->_handler(self->_result);
+        });
+    }
+
+    // 中止仍在进行的传输, 已完成的部分保留在区间中
+    void abort()
+    {
+        for (auto& conn : _connections)
+        {
+            if (!conn->busy)
+                continue;
+            curl_multi_remove_handle(_multi, conn->session->handle());
+            conn->session->finish(CURLE_ABORTED_BY_CALLBACK);
+            conn->busy = false;
+            if (_multipoint)
+                _rf.deallocate(conn->range);
+        }
+        if (_probe)
+        {
+            curl_multi_remove_handle(_multi, _probe);
+            curl_easy_cleanup(_probe);
+            curl_slist_free_all(_probeHeader);
+            _probe = nullptr;
+            _probeHeader = nullptr;
+        }
+    }
+
+    // 保存最后的进度并关闭文件, 关闭失败时更新 error
+    void close_file(std::error_code& error)
+    {
+        if (_rf)
+        {
+            std::error_code ecode;
+            if (error && !_rf.dump(ecode)) // 未完成时保存最后的进度, 以便下次续传
+                NLOG_WAR("RangeFile::dump() failed, error: ") << ecode.message();
+
+            auto finished = !error;
+            if (!_rf.close(finished, ecode)) {
+                error = error ? error : ecode; // 若关闭前有错误, 则不改变之前的错误
+                NLOG_ERR("RangeFile::close({1}) failed, error: {2}")
+                    % (finished ? "true" : "false")
+                    % ecode.message();
+            }
+        }
+    }
+
+    // 释放 multi 句柄及套接字
+    void release()
+    {
+        // 释放 multi 句柄会关闭缓存的连接, 须在套接字表之前
+        curl_multi_cleanup(_multi);
+        _multi = nullptr;
+        _connections.clear();
+        for (auto& item : _sockets) {
+            boost::system::error_code ecode;
+            item.second->closed = true;
+            item.second->socket.close(ecode);
+        }
+        _sockets.clear();
+    }
+
+public:
+    AsyncDownload(
+        asio::io_context& context,
+        const std::string& url,
+        const std::filesystem::path& filename,
+        const std::function<bool(const download_status&)>& callback,
+        const download_preference& config,
+        const std::function<void(const std::error_code&)>& handler)
+        : _context(context)
+        , _strand(asio::make_strand(context))
+        , _timer(context)
+        , _ticker(context)
+        , _url(url)
+        , _filename(filename)
+        , _callback(callback)
+        , _config(config)
+        , _handler(handler)
+    {
+        _multi = curl_multi_init();
+        if (_multi == nullptr)
+            throw std::runtime_error("curl_multi_init() failed");
+
+        curl_multi_setopt(_multi, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+        curl_multi_setopt(_multi, CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(_multi, CURLMOPT_TIMERFUNCTION, TimerCallback);
+        curl_multi_setopt(_multi, CURLMOPT_TIMERDATA, this);
+    }
+
+    ~AsyncDownload()
+    {
+        // context 在下载完成之前被销毁, 此时不再调用完成回调
+        // 或者结束时的检查点及关闭文件尚未完成
+        if (!_done)
+        {
+            _done = true;
+            _flag = kCancelled;
+            _result = util::MakeError(util::kOperationInterrupted);
+            abort();
+        }
+        close_file(_result);
+        release();
+    }
+
+    AsyncDownload(const AsyncDownload&) = delete;
+    AsyncDownload& operator=(const AsyncDownload&) = delete;
+
+    void start()
+    {
+        asio::post(_strand, [self = shared_from_this()]
+        {
+            NLOG_PRO("AsyncDownload() ...");
+            NLOG_PRO(" - URL : ") << self->_url;
+            NLOG_PRO(" - File: ") << self->_filename;
+            NLOG_PRO(" - TimeOut(MS): ") << self->_config.timeout;
+            NLOG_PRO(" - Connections: ") << self->_config.connections;
+            NLOG_PRO(" - BlockSize: ") << self->_config.blockSize;
+
+            try
+            {
+                self->_start = chr::steady_clock::now();
+                if (self->_config.connections > 1) //  单点下载不用探测文件长度
+                    self->probe(self->_config.timeout);
+                else
+                    self->download();
+            }
+            catch (const std::exception& e)
+            {
+                NLOG_ERR("Unhandled exception: ") << e.what();
+                self->finish(util::MakeError(util::kRuntimeError));
+            }
+        });
+    }
+
+};
+
+void AsyncDownloadFile(
+    boost::asio::io_context& context,
+    const std::string& url,
+    const std::filesystem::path& filename,
+    const std::function<bool(const download_status&)>& callback,
+    const download_preference config,
+    const std::function<void(const std::error_code&)>& handler)
+{
+    auto task = std::make_shared<AsyncDownload>(context, url, filename, callback, config, handler);
+    task->start();
+}
+
+//
+// 简易的单元测试: 同一个 context 上的回环服务器, 覆盖 探测 -> 多点下载 -> 完成
+//
+#if DEBUG || _DEBUG
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <boost/asio/write.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+
+namespace {
+
+struct LoopbackStats
+{
+    std::string data;
+    int         heads  = 0;  // HEAD 请求数
+    int         ranges = 0;  // 范围请求数
+};
+
+// 一个连接, 依次处理保持连接上的 HEAD 及 GET(含范围)请求
+class LoopbackSession : public std::enable_shared_from_this<LoopbackSession>
+{
+    asio::ip::tcp::socket          _socket;
+    asio::streambuf                _request;
+    std::string                    _response;
+    std::shared_ptr<LoopbackStats> _stats;
+
+public:
+    LoopbackSession(asio::ip::tcp::socket socket, std::shared_ptr<LoopbackStats> stats)
+        : _socket(std::move(socket)), _stats(std::move(stats))
+    {}
+
+    void read()
+    {
+        asio::async_read_until(_socket, _request, "\r\n\r\n",
+            [self = shared_from_this()](const boost::system::error_code& ecode, std::size_t size) {
+                if (ecode)
+                    return;
+                std::string head(asio::buffers_begin(self->_request.data()),
+                                 asio::buffers_begin(self->_request.data()) + size);
+                self->_request.consume(size);
+                self->respond(head);
+            });
+    }
+
+private:
+    void respond(const std::string& head)
+    {
+        int64_t size = (int64_t)_stats->data.size();
+        int64_t start = 0, end = size - 1;
+        bool body = head.compare(0, 5, "HEAD ") != 0;
+        bool range = false;
+
+        auto pos = head.find("\r\nRange: bytes=");
+        if (pos != std::string::npos)
+        {
+            long long first = 0, last = 0;
+            int count = std::sscanf(head.c_str() + pos + 15, "%lld-%lld", &first, &last);
+            range = count >= 1;
+            start = first;
+            end = count == 2 ? std::min<int64_t>(last, size - 1) : size - 1;
+        }
+        if (body)
+            _stats->ranges += range;
+        else
+            _stats->heads++;
+
+        std::ostringstream os;
+        os << (range ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n")
+           << "Accept-Ranges: bytes\r\n"
+           << "ETag: \"loopback\"\r\n"
+           << "Content-Length: " << end - start + 1 << "\r\n";
+        if (range)
+            os << "Content-Range: bytes " << start << "-" << end << "/" << size << "\r\n";
+        os << "\r\n";
+        _response = os.str();
+        if (body)
+            _response.append(_stats->data, (size_t)start, (size_t)(end - start + 1));
+
+        asio::async_write(_socket, asio::buffer(_response),
+            [self = shared_from_this()](const boost::system::error_code& ecode, std::size_t) {
+                if (!ecode)
+                    self->read();
+            });
+    }
+};
+
+} // namespace
+
+void UtilTestForAsyncDownload()
+{
+    asio::io_context context;
+    auto stats = std::make_shared<LoopbackStats>();
+    stats->data.resize(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < stats->data.size(); ++i)
+        stats->data[i] = (char)(i * 7 + (i >> 12));
+
+    asio::ip::tcp::acceptor acceptor(context, { asio::ip::make_address("127.0.0.1"), 0 });
+    std::function<void()> accept = [&] {
+        acceptor.async_accept([&](const boost::system::error_code& ecode, asio::ip::tcp::socket socket) {
+            if (ecode)
+                return;
+            std::make_shared<LoopbackSession>(std::move(socket), stats)->read();
+            accept();
+        });
+    };
+    accept();
+
+    auto filename = std::filesystem::temp_directory_path() / "async_download.bin";
+    std::error_code ecode;
+    std::filesystem::remove(filename, ecode);
+
+    download_preference config;
+    config.connections = 4;
+    config.blockSize = 256 * 1024;
+    config.durable = true; // 检查点及关闭文件在线程池中执行
+    config.checkpointBytes = 512 * 1024;
+
+    bool completed = false;
+    std::error_code result;
+    auto url = "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) + "/data.bin";
+    AsyncDownloadFile(context, url, filename, nullptr, config, [&](const std::error_code& error) {
+        completed = true;
+        result = error;
+        boost::system::error_code ignored;
+        acceptor.close(ignored); // 连接已由下载关闭, 服务器随之结束
+    });
+    context.run();
+
+    util_assert(completed && !result);
+    util_assert(stats->heads >= 1);
+    util_assert(stats->ranges >= 2);
+    {
+        std::ifstream file(filename, std::ios::binary);
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        util_assert(content == stats->data);
+    }
+    util_assert(!std::filesystem::exists(std::filesystem::path(filename) += L".meta"));
+    std::filesystem::remove(filename, ecode);
+}
+#endif
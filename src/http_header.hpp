@@ -0,0 +1,248 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef http_header_h__
+#define http_header_h__
+
+#include <ctime>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <string_view>
+#include <curl/curl.h>
+
+#include "downloader.h"
+#include "common/assert.hpp"
+
+//
+// HTTP 响应头解析
+//
+// 字段名大小写不敏感(HTTP/2 的字段名均为小写), 逐行解析时仅使用 string_view,
+// 只有命中关心的字段时才会赋值, 不会为每一行构造临时字符串.
+//
+
+inline std::string_view HeaderTrim(std::string_view text)
+{
+    while (!text.empty() && std::isspace((unsigned char)text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && std::isspace((unsigned char)text.back()))
+        text.remove_suffix(1);
+    return text;
+}
+
+inline bool HeaderEquals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i]))
+            return false;
+    }
+    return true;
+}
+
+inline bool HeaderParseInt(std::string_view text, int64_t& value)
+{
+    text = HeaderTrim(text);
+    if (text.empty())
+        return false;
+
+    int64_t result = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9')
+            return false;
+        int d = c - '0';
+        if (result > (INT64_MAX - d) / 10) // 溢出, 视为无效
+            return false;
+        result = result * 10 + d;
+    }
+    value = result;
+    return true;
+}
+
+//! @brief 解析 Content-Range, 形如: "bytes 0-99/1234", "bytes */1234", "bytes 0-99/*"
+//! @param start, end 响应的范围, 未指定时为 -1
+//! @param total 文件总长度, 未知时为 -1
+//! @return 格式有效返回 true
+inline bool ParseContentRange(std::string_view text, int64_t& start, int64_t& end, int64_t& total)
+{
+    start = end = total = -1;
+
+    text = HeaderTrim(text);
+    if (text.size() < 6 || !HeaderEquals(text.substr(0, 6), "bytes "))
+        return false;
+    text.remove_prefix(6);
+
+    auto slash = text.find('/');
+    if (slash == std::string_view::npos)
+        return false;
+
+    auto range = HeaderTrim(text.substr(0, slash));
+    auto size  = HeaderTrim(text.substr(slash + 1));
+    if (size != "*" && !HeaderParseInt(size, total))
+        return false;
+
+    if (range != "*")
+    {
+        auto dash = range.find('-');
+        if (dash == std::string_view::npos ||
+            !HeaderParseInt(range.substr(0, dash), start) ||
+            !HeaderParseInt(range.substr(dash + 1), end) ||
+            start > end) {
+            start = end = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+//! @brief 解析响应头的一行, 并填充到文件属性中
+//! 遇到状态行(重定向后的新响应)时, 重置之前解析的字段
+inline void ParseHeaderLine(const char* data, size_t size, file_attribute& attribute)
+{
+    std::string_view line(data, size);
+    attribute.header.append(data, size);
+
+    if (line.size() > 5 && HeaderEquals(line.substr(0, 5), "HTTP/"))
+    {
+        auto header = std::move(attribute.header);
+        attribute = {};
+        attribute.header = std::move(header);
+        return;
+    }
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos)
+        return;
+
+    auto name  = HeaderTrim(line.substr(0, colon));
+    auto value = HeaderTrim(line.substr(colon + 1));
+    switch (name.empty() ? 0 : std::tolower((unsigned char)name[0]))
+    {
+    case 'a':
+        if (HeaderEquals(name, "Accept-Ranges"))
+            attribute.acceptRanges.assign(value);
+        break;
+
+    case 'c':
+        if (HeaderEquals(name, "Content-Range"))
+            attribute.contentRange.assign(value);
+        else if (HeaderEquals(name, "Content-Encoding"))
+            attribute.contentEncoding.assign(value);
+        else if (HeaderEquals(name, "Content-Disposition"))
+            attribute.contentDisposition.assign(value);
+        break;
+
+    case 'e':
+        if (HeaderEquals(name, "ETag"))
+            attribute.etag.assign(value);
+        break;
+
+    case 'l':
+        if (HeaderEquals(name, "Last-Modified"))
+            attribute.lastModified.assign(value);
+        break;
+
+    case 'r':
+        if (HeaderEquals(name, "Retry-After"))
+        {
+            // 秒数 或 HTTP-date
+            int64_t seconds = -1;
+            if (!HeaderParseInt(value, seconds))
+            {
+                char date[64] = {};
+                value.copy(date, std::min(value.size(), sizeof(date) - 1));
+                auto when = curl_getdate(date, nullptr);
+                if (when >= 0)
+                    seconds = std::max<int64_t>(when - std::time(nullptr), 0);
+            }
+            attribute.retryAfter = seconds;
+        }
+        break;
+    }
+}
+
+//! @brief libcurl 的响应头回调, 逐行解析至文件属性
+inline size_t WriteHeadCallback(
+    char* buffer, 
+    size_t size,
+    size_t nitems, 
+    file_attribute* attribute) 
+{
+    size *= nitems;
+    ParseHeaderLine(buffer, size, *attribute);
+    return size;
+}
+
+//! @brief 是否支持范围请求
+inline bool SupportRanges(const file_attribute& attribute)
+{
+    return !attribute.acceptRanges.empty() && !HeaderEquals(attribute.acceptRanges, "none");
+}
+
+//! @brief 续传的校验符, 用于 If-Range: 强 ETag 优先, 其次 Last-Modified; 弱 ETag 不能用于 If-Range
+inline std::string RangeValidator(const file_attribute& attribute)
+{
+    if (!attribute.etag.empty() && attribute.etag.compare(0, 2, "W/") != 0)
+        return attribute.etag;
+    return attribute.lastModified;
+}
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForHttpHeader()
+{
+    auto parse = [](file_attribute& attribute, std::string_view line) {
+        ParseHeaderLine(line.data(), line.size(), attribute);
+    };
+
+    file_attribute attribute;
+    parse(attribute, "HTTP/1.1 302 Found\r\n");
+    parse(attribute, "Accept-Ranges: none\r\n");
+    util_assert(!SupportRanges(attribute));
+
+    parse(attribute, "HTTP/2 206\r\n");
+    util_assert(attribute.acceptRanges.empty());
+    parse(attribute, "accept-ranges: bytes\r\n");
+    parse(attribute, "content-range: bytes 0-99/1234\r\n");
+    parse(attribute, "etag: \"5e3c-abc\"\r\n");
+    parse(attribute, "last-modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n");
+    parse(attribute, "content-encoding: gzip\r\n");
+    parse(attribute, "content-disposition: attachment; filename=\"a.zip\"\r\n");
+    parse(attribute, "RETRY-AFTER:  120 \r\n");
+    parse(attribute, "\r\n");
+
+    util_assert(SupportRanges(attribute));
+    util_assert(attribute.acceptRanges == "bytes");
+    util_assert(attribute.contentRange == "bytes 0-99/1234");
+    util_assert(attribute.etag == "\"5e3c-abc\"");
+    util_assert(attribute.lastModified == "Wed, 21 Oct 2015 07:28:00 GMT");
+    util_assert(attribute.contentEncoding == "gzip");
+    util_assert(attribute.contentDisposition == "attachment; filename=\"a.zip\"");
+    util_assert(attribute.retryAfter == 120);
+    util_assert(RangeValidator(attribute) == "\"5e3c-abc\"");
+    attribute.etag = "W/\"5e3c-abc\"";
+    util_assert(RangeValidator(attribute) == "Wed, 21 Oct 2015 07:28:00 GMT");
+
+    int64_t start, end, total;
+    util_assert(ParseContentRange(attribute.contentRange, start, end, total));
+    util_assert(start == 0 && end == 99 && total == 1234);
+    util_assert(ParseContentRange("bytes */1234", start, end, total));
+    util_assert(start == -1 && end == -1 && total == 1234);
+    util_assert(ParseContentRange("bytes 0-99/*", start, end, total));
+    util_assert(start == 0 && end == 99 && total == -1);
+    util_assert(!ParseContentRange("bytes 99-0/1234", start, end, total));
+    util_assert(ParseContentRange("bytes 0-99/9223372036854775807", start, end, total));
+    util_assert(total == INT64_MAX);
+    util_assert(!ParseContentRange("bytes 0-99/9223372036854775808", start, end, total));
+    util_assert(!ParseContentRange("bytes 0-99999999999999999999/1234", start, end, total));
+}
+#endif
+
+#endif // http_header_h__
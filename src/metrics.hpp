@@ -0,0 +1,279 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef metrics_h__
+#define metrics_h__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <initializer_list>
+
+#include "common/assert.hpp"
+
+//
+// 下载器的运行指标, 以 OpenMetrics (Prometheus) 文本格式输出
+//
+// 计数按线程分片: 每个线程固定映射到一个独占缓存行的分片, 记录只是一次 relaxed 的原子加法,
+// 没有锁也没有分片之间的伪共享; 仅在输出时汇总所有分片, 因此输出的是近似同一时刻的值.
+//
+
+constexpr size_t kMetricShards  = 16;
+constexpr size_t kMetricBuckets = 12; // 直方图的桶数上限, 不含 +Inf
+
+//! 当前线程的分片
+inline size_t MetricShard()
+{
+    static std::atomic<size_t> next{ 0 };
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+    return shard;
+}
+
+//
+// 单调递增的计数器
+//
+class MetricCounter
+{
+    struct alignas(64) Shard {
+        std::atomic<int64_t> value{ 0 };
+    };
+    std::array<Shard, kMetricShards> _shards;
+
+public:
+    void add(int64_t n = 1) {
+        _shards[MetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const
+    {
+        int64_t sum = 0;
+        for (auto const& shard : _shards)
+            sum += shard.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+//
+// 可增可减的瞬时值, 变化远少于计数器, 不分片
+//
+class MetricGauge
+{
+    std::atomic<int64_t> _value{ 0 };
+
+public:
+    void add(int64_t n = 1) {
+        _value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+};
+
+//
+// 时长的直方图, 以微秒记录, 输出时转换为秒
+//
+class MetricHistogram
+{
+    struct alignas(64) Shard {
+        std::array<std::atomic<int64_t>, kMetricBuckets + 1> counts{}; // 末尾为 +Inf
+        std::atomic<int64_t> sum{ 0 };
+    };
+
+    std::vector<int64_t>              _bounds; // 各个桶的上限(微秒), 升序
+    std::array<Shard, kMetricShards>  _shards;
+
+public:
+    //! @param bounds 各个桶的上限(秒), 升序
+    explicit MetricHistogram(std::initializer_list<double> bounds)
+    {
+        util_assert(bounds.size() <= kMetricBuckets);
+        for (auto bound : bounds)
+            _bounds.push_back(static_cast<int64_t>(bound * 1000000 + 0.5));
+    }
+
+    void observe(int64_t microseconds)
+    {
+        auto index = std::lower_bound(_bounds.begin(), _bounds.end(), microseconds) - _bounds.begin();
+        auto& shard = _shards[MetricShard()];
+        shard.counts[index].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(microseconds, std::memory_order_relaxed);
+    }
+
+    void observe(std::chrono::steady_clock::duration elapsed) {
+        observe(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    //! 汇总所有分片
+    //! @param counts 输出各个桶(含 +Inf)的累积计数
+    //! @param sum 输出观测值的总和(微秒)
+    void collect(std::vector<int64_t>& counts, int64_t& sum) const
+    {
+        counts.assign(_bounds.size() + 1, 0);
+        sum = 0;
+        for (auto const& shard : _shards)
+        {
+            for (size_t i = 0; i < counts.size(); ++i)
+                counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+            sum += shard.sum.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 1; i < counts.size(); ++i)
+            counts[i] += counts[i - 1];
+    }
+
+    const std::vector<int64_t>& bounds() const {
+        return _bounds;
+    }
+};
+
+//
+// 记录作用域的时长
+//
+class MetricTimer
+{
+    MetricHistogram& _histogram;
+    std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+public:
+    explicit MetricTimer(MetricHistogram& histogram) : _histogram(histogram) {}
+    ~MetricTimer() { _histogram.observe(std::chrono::steady_clock::now() - _start); }
+};
+
+//
+// 请求错误的分类, 与 HandleRequestError() 的处理对应
+//
+enum metric_error
+{
+    kMetricErrorNetwork = 0, // 网络错误, 由外部重试
+    kMetricErrorHttp,        // HTTP 错误状态
+    kMetricErrorFilesystem,  // 文件操作错误, 致命
+    kMetricErrorCancelled,   // 取消
+    kMetricErrorRuntime,     // 未知错误 或 运行时错误
+    kMetricErrorClasses,
+};
+
+//
+// 指标的注册表, 所有的下载共享
+//
+class Metrics
+{
+public:
+    MetricCounter   receivedBytes;    // 接收的响应体字节数
+    MetricCounter   requests;         // 发起的请求数
+    MetricGauge     connections;      // 进行中的请求数
+    std::array<MetricCounter, kMetricErrorClasses> errors;
+
+    MetricHistogram rangeLatency  { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+    MetricHistogram writeLatency  { 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.1, 0.5 };
+    MetricHistogram checkpoint    { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5 };
+
+    static Metrics& Instance()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void error(metric_error kind) {
+        errors[kind].add();
+    }
+
+    //! @brief 以 OpenMetrics 文本格式输出
+    std::string expose() const
+    {
+        std::string text;
+        auto family = [&](const char* name, const char* type, const char* help) {
+            text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+            text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        };
+        auto sample = [&](const std::string& name, int64_t value) {
+            text.append(name).append(" ").append(std::to_string(value)).append("\n");
+        };
+        auto seconds = [](int64_t microseconds) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.6g", microseconds / 1000000.0);
+            return std::string(buffer);
+        };
+        auto histogram = [&](const char* name, const char* help, const MetricHistogram& h) {
+            std::vector<int64_t> counts;
+            int64_t sum = 0;
+            h.collect(counts, sum);
+            family(name, "histogram", help);
+            for (size_t i = 0; i < counts.size(); ++i)
+            {
+                auto le = i < h.bounds().size() ? seconds(h.bounds()[i]) : std::string("+Inf");
+                sample(std::string(name) + "_bucket{le=\"" + le + "\"}", counts[i]);
+            }
+            text.append(name).append("_sum ").append(seconds(sum)).append("\n");
+            sample(std::string(name) + "_count", counts.back());
+        };
+
+        family("downloader_received_bytes", "counter", "Response body bytes received.");
+        sample("downloader_received_bytes_total", receivedBytes.value());
+
+        family("downloader_requests", "counter", "HTTP requests started, including probes and retries.");
+        sample("downloader_requests_total", requests.value());
+
+        static const char* const kClasses[kMetricErrorClasses] = { "network", "http", "filesystem", "cancelled", "runtime" };
+        family("downloader_request_errors", "counter", "Failed requests by error class, network errors are retried.");
+        for (int i = 0; i < kMetricErrorClasses; ++i)
+            sample(std::string("downloader_request_errors_total{class=\"") + kClasses[i] + "\"}", errors[i].value());
+
+        family("downloader_active_connections", "gauge", "Requests currently in progress.");
+        sample("downloader_active_connections", connections.value());
+
+        histogram("downloader_range_latency_seconds", "Time from starting a request to its first response byte.", rangeLatency);
+        histogram("downloader_disk_write_seconds", "Duration of a positional write to the destination file.", writeLatency);
+        histogram("downloader_checkpoint_seconds", "Duration of saving the progress meta data.", checkpoint);
+
+        text.append("# EOF\n");
+        return text;
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+#include <thread>
+
+inline void UtilTestForMetrics()
+{
+    MetricCounter counter;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i)
+        threads.emplace_back([&] { for (int j = 0; j < 1000; ++j) counter.add(); });
+    for (auto& t : threads)
+        t.join();
+    util_assert(counter.value() == 8000);
+
+    MetricHistogram histogram{ 0.001, 0.01 };
+    histogram.observe(500);     // <= 1ms
+    histogram.observe(1000);    // <= 1ms, 上限包含在桶内
+    histogram.observe(5000);    // <= 10ms
+    histogram.observe(2000000); // +Inf
+    std::vector<int64_t> counts;
+    int64_t sum = 0;
+    histogram.collect(counts, sum);
+    util_assert((counts == std::vector<int64_t>{ 2, 3, 4 }) && sum == 2006500);
+
+    Metrics metrics;
+    metrics.receivedBytes.add(1024);
+    metrics.error(kMetricErrorNetwork);
+    metrics.rangeLatency.observe(20000);
+    auto text = metrics.expose();
+    util_assert(text.find("downloader_received_bytes_total 1024\n") != std::string::npos);
+    util_assert(text.find("downloader_request_errors_total{class=\"network\"} 1\n") != std::string::npos);
+    util_assert(text.find("downloader_range_latency_seconds_bucket{le=\"0.025\"} 1\n") != std::string::npos);
+    util_assert(text.find("downloader_range_latency_seconds_sum 0.02\n") != std::string::npos);
+    util_assert(text.size() > 5 && text.compare(text.size() - 6, 6, "# EOF\n") == 0);
+}
+#endif
+
+#endif // metrics_h__
@@ -0,0 +1,281 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef origin_cache_h__
+#define origin_cache_h__
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include "nlog.h"
+#include "common/assert.hpp"
+
+//
+// 源站的能力及性能的缓存 (持久化)
+//
+// 源站即 url 的 scheme://host[:port], 记录是否支持范围请求, 可用的连接数上限, 吞吐量及请求的等待时间.
+// 已知不支持范围请求的源站跳过探测直接单点下载; 连接数不超过源站的上限, 以免多出的连接被拒绝;
+// 分块按带宽时延积放大, 高时延的源站不必由每个分块的请求往返拖慢.
+// 记录超过 kExpire 后失效, 重新探测. 缓存文件为空时不启用.
+//
+struct OriginRecord
+{
+    bool    ranges      = true;  // 支持范围请求
+    int     connections = 0;     // 可用的连接数上限, 0 表示尚未遇到上限
+    int64_t throughput  = 0;     // 多点下载的吞吐量(字节/秒), 平滑后的值
+    int64_t rate        = 0;     // 单个连接收到首字节之后的速度(字节/秒), 平滑后的值
+    int64_t latency     = 0;     // 请求的等待时间(发出请求至收到首字节, 微秒), 平滑后的值
+    int64_t updated     = 0;     // 更新时间(Unix 秒)
+};
+
+class OriginCache
+{
+    std::mutex                          _mutex;
+    std::filesystem::path               _filename;
+    std::map<std::string, OriginRecord> _records;
+
+public:
+    static constexpr int64_t kExpire       = 7 * 24 * 3600;    // 记录的有效期(秒)
+    static constexpr int64_t kBlockRounds  = 16;               // 分块的传输时长至少为请求等待时间的倍数
+    static constexpr int64_t kBlockAlign   = 64 * 1024;
+    static constexpr int64_t kMaxBlockSize = 32 * 1024 * 1024;
+
+    static OriginCache& Instance()
+    {
+        static OriginCache cache;
+        return cache;
+    }
+
+    static int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    //! url 的源站, 协议及主机名不区分大小写, 不含用户信息
+    static std::string Origin(const std::string& url)
+    {
+        auto scheme = url.find("://");
+        if (scheme == std::string::npos)
+            return {};
+        auto begin = scheme + 3;
+        auto end = url.find_first_of("/?#", begin);
+        auto authority = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        auto at = authority.rfind('@');
+        if (at != std::string::npos)
+            authority.erase(0, at + 1);
+        if (authority.empty())
+            return {};
+
+        auto origin = url.substr(0, begin) + authority;
+        std::transform(origin.begin(), origin.end(), origin.begin(),
+            [](unsigned char c) { return (char)std::tolower(c); });
+        return origin;
+    }
+
+    //! 按带宽时延积估计分块大小, 使请求的等待不超过分块传输时长的 1/kBlockRounds
+    //! @return 不小于 minimum, 估计值不超过 kMaxBlockSize
+    static int BlockSize(const OriginRecord& record, int minimum)
+    {
+        int64_t size = record.rate * record.latency / 1000000 * kBlockRounds;
+        size = std::min(size / kBlockAlign * kBlockAlign, kMaxBlockSize);
+        return (int)std::max<int64_t>(size, minimum);
+    }
+
+    //! 指定缓存文件并加载, 为空时不启用
+    void configure(const std::filesystem::path& filename)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        if (filename == _filename)
+            return;
+        _filename = filename;
+        _records.clear();
+        if (!_filename.empty())
+            load();
+    }
+
+    bool enabled()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return !_filename.empty();
+    }
+
+    //! 查找源站的有效记录
+    bool find(const std::string& url, OriginRecord& record)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        if (_filename.empty())
+            return false;
+        auto it = _records.find(Origin(url));
+        if (it == _records.end() || Now() - it->second.updated > kExpire)
+            return false;
+        record = it->second;
+        return true;
+    }
+
+    //! 记录探测 或 响应所确认的范围请求支持
+    void record_ranges(const std::string& url, bool ranges)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto origin = Origin(url);
+        if (_filename.empty() || origin.empty())
+            return;
+
+        auto now = Now();
+        auto& record = _records[origin];
+        bool stale = now - record.updated > kExpire;
+        if (stale)
+            record = {};
+        if (!stale && record.ranges == ranges)
+            return;
+        record.ranges = ranges;
+        record.updated = now;
+        save();
+    }
+
+    //! 记录一次多点下载
+    //! @param connections 使用的连接数
+    //! @param limit 部分连接始终被拒绝时为可用的连接数, 否则为 0
+    //! @param throughput, rate, latency 观测值, 0 表示没有有效的观测
+    void record_transfer(
+        const std::string& url,
+        int connections,
+        int limit,
+        int64_t throughput,
+        int64_t rate,
+        int64_t latency)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto origin = Origin(url);
+        if (_filename.empty() || origin.empty())
+            return;
+
+        auto now = Now();
+        auto& record = _records[origin];
+        if (now - record.updated > kExpire)
+            record = {};
+
+        // 以更多的连接下载而未遇到上限, 说明上限已经提高
+        record.ranges = true;
+        if (limit > 0)
+            record.connections = limit;
+        else if (record.connections > 0 && connections > record.connections)
+            record.connections = 0;
+
+        auto smooth = [](int64_t& value, int64_t sample) {
+            if (sample > 0)
+                value = value > 0 ? (value + sample) / 2 : sample;
+        };
+        smooth(record.throughput, throughput);
+        smooth(record.rate, rate);
+        smooth(record.latency, latency);
+        record.updated = now;
+        save();
+    }
+
+private:
+    // 每行一个源站: origin ranges connections throughput rate latency updated
+    void load()
+    {
+        std::ifstream file(_filename);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream is(line);
+            std::string origin;
+            OriginRecord record;
+            if (is >> origin >> record.ranges >> record.connections >> record.throughput
+                   >> record.rate >> record.latency >> record.updated)
+                _records[origin] = record;
+        }
+
+        NLOG_PRO("OriginCache load {1}, origins: {2}")
+            % _filename.wstring()
+            % _records.size();
+    }
+
+    // 写入临时文件后替换, 任意时刻磁盘上都是一份完整的缓存
+    void save()
+    {
+        auto now = Now();
+        auto temp = std::filesystem::path(_filename) += L".temp";
+        {
+            std::ofstream file(temp, std::ios::trunc);
+            file << "# origin ranges connections throughput rate latency updated\n";
+            for (auto const& [origin, r] : _records)
+            {
+                if (now - r.updated > kExpire)
+                    continue;
+                file << origin << " " << r.ranges << " " << r.connections << " " << r.throughput << " "
+                     << r.rate << " " << r.latency << " " << r.updated << "\n";
+            }
+            if (!file.flush())
+            {
+                NLOG_WAR("OriginCache failed to write {1}") % temp.wstring();
+                return;
+            }
+        }
+
+        std::error_code ecode;
+        std::filesystem::rename(temp, _filename, ecode);
+        if (ecode)
+            NLOG_WAR("OriginCache failed to replace {1}, error: {2}") % _filename.wstring() % ecode.message();
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForOriginCache()
+{
+    util_assert(OriginCache::Origin("HTTPS://user:pw@Example.com:8443/a/b.zip?x=1") == "https://example.com:8443");
+    util_assert(OriginCache::Origin("http://127.0.0.1#top") == "http://127.0.0.1");
+    util_assert(OriginCache::Origin("example.com/a.zip").empty());
+
+    OriginRecord record;
+    util_assert(OriginCache::BlockSize(record, 1024 * 1024) == 1024 * 1024);
+    record.rate = 10 * 1024 * 1024; // 10MiB/s, 50ms
+    record.latency = 50000;
+    util_assert(OriginCache::BlockSize(record, 1024 * 1024) == 8 * 1024 * 1024);
+    record.latency = 1000000;
+    util_assert(OriginCache::BlockSize(record, 1024 * 1024) == OriginCache::kMaxBlockSize);
+
+    auto path = std::filesystem::temp_directory_path() / "origin_cache.txt";
+    std::error_code ecode;
+    std::filesystem::remove(path, ecode);
+    {
+        OriginCache cache;
+        util_assert(!cache.find("http://a.com/x", record)); // 未启用
+        cache.record_ranges("http://a.com/x", false);
+        cache.configure(path);
+        cache.record_ranges("http://a.com/x", false);
+        cache.record_transfer("http://b.com/x", 8, 3, 1000, 400, 20000);
+        cache.record_transfer("http://b.com/y", 3, 0, 3000, 1000, 40000);
+    }
+
+    OriginCache cache;
+    cache.configure(path);
+    util_assert(cache.find("http://A.com/other", record) && !record.ranges);
+    util_assert(cache.find("http://b.com/z", record) && record.ranges && record.connections == 3);
+    util_assert(record.throughput == 2000 && record.rate == 700 && record.latency == 30000);
+    cache.record_transfer("http://b.com/z", 6, 0, 0, 0, 0); // 更多的连接未遇到上限
+    util_assert(cache.find("http://b.com/z", record) && record.connections == 0 && record.throughput == 2000);
+    util_assert(!cache.find("http://c.com/", record));
+
+    std::filesystem::remove(path, ecode);
+}
+#endif
+
+#endif // origin_cache_h__
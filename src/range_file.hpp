@@ -9,7 +9,10 @@
 
 #include <set>
 #include <mutex>
+#include <atomic>
 #include <memory>
+#include <thread>
+#include <vector>
 #include <fstream>
 #include <algorithm>
 #include <filesystem>
@@ -17,109 +20,457 @@
 #include "config.h"
 #include "uerror.h"
 #include "range.hpp"
+#include "range_meta.hpp"
+#include "range_policy.hpp"
+#include "range_storage.hpp"
 #include "common/scope.hpp"
 #include "common/assert.hpp"
 #include "common/bytedata.hpp"
 #include "filesystem/path_util.h"
 
-#include <boost/algorithm/string.hpp>
-#include <boost/serialization/set.hpp>
-#include <boost/serialization/serialization.hpp>
+#ifdef RANGE_FILE_STATISTICS
+#   include <chrono>
+#endif
 
+#ifdef RANGE_FILE_STATISTICS
 //
-// 包含填充状态的文件区间
+// 锁的争用统计, 仅用于基准测试评估引擎的改动
 //
-struct Range2 : public Range {
-    int64_t position = 0; // 不包含右边端点
-    enum {
-        kUnfilled,
-        kPending,
-        kPartial,
-        kFilled,
-    } state = kUnfilled;
+struct RangeFileStatistics {
+    std::atomic<int64_t> lockAcquires  = 0; // 加锁次数
+    std::atomic<int64_t> lockContended = 0; // 发生等待的次数
+    std::atomic<int64_t> lockWaitNanos = 0; // 等待的总时长(纳秒)
 };
+#endif
 
 //
-// 区间化文件的元数据, 用于状态的序列化
+// 区间状态的快照, 用于界面显示分段的进度
 //
-struct RangeFileMeta {
-    int64_t          _blockHint = 0;
-    int64_t          _bytesTotal = -1;
-    int64_t          _bytesProcessed = 0;
-    std::set<Range2> _allocateRanges;
-    std::set<Range2> _finishedRanges;
-    std::set<Range2> _availableRanges;
-
-    void trace() {
-        std::list<std::string> text;
-        for (auto const& r : _finishedRanges)
-            text.push_back(util::sformat("[%08" PRIx64 ", %08" PRIx64 "]", r.start, r.end));
-        NLOG_PRO(" - Status: finished-ranges: {1}, available-ranges: {2}, available-ranges: {3}")
-            % _finishedRanges.size()
-            % _availableRanges.size()
-            % _allocateRanges.size();
-        NLOG_PRO(" - Finished: ") << boost::join(text, ", ");
-        NLOG_PRO(" - BytesProcessed: ") << _bytesProcessed;
+struct RangeProgress
+{
+    int64_t             total     = -1;
+    int64_t             processed = 0;
+    uint64_t            epoch     = 0;  // 已完成区间的版本, 与上次相同时 finished 没有变化
+    std::vector<Range>  finished;       // 已完成的区间, 升序
+    std::vector<Range2> inflight;       // 在途的区间, position 为已填充的位置, 按 start 升序
+    std::vector<Range>  available;      // 未完成且不在途的区间, 升序
+};
+
+// 区间化文件实现
+//
+// 1. 分配未使用区间
+//      待分配的区间在首次分配时按 _blockHint 切分为队列, 通过原子游标无锁的分配
+//      续传时恢复的区间同样在此切分, 因此可以使用与上次不同的 _blockHint
+//      归还的区间(未填充, 部分填充的剩余部分)优先分配, 这部分由 _mutex 保护
+// 1. 区间填充时, 会将数据按位置写入文件, 填充位置由区间所在的槽位原子的记录, 无需加锁
+// 1. 区间完毕后, 记录已经填充的区间并与相邻的区间合并, 部分填充的区间则需要缩小, 仅此处加锁
+// 1. 持久模式下, 检查点先同步数据文件再原子的替换元数据, 元数据记录的区间在断电后一定已经落盘
+// 1. 没有可分配的区间时, 空闲的连接可以对在途区间未填充的后缀发起对冲请求, 两者互为对端,
+//    先完成者胜出, 另一方在下次填充时被中止; 重复的部分在归还时扣除, 已完成的区间不会重复计数
+// 1. 开放区间模式下, 连接获得整个未完成的区间, 新加入的连接拆分剩余最多的在途区间的后半部分,
+//    持有者在每次填充时以槽位中的结束位置为准, 到达拆分点即停止
+// 1. 已完成的区间在变化时复制到双缓冲的视图中发布(写时复制), 读者(界面, dump)按读者计数固定视图,
+//    无需 _mutex; 备用的视图仍有读者时推迟发布, 由下一次变化 或 读者补发
+
+class RangeFile
+{
+    // 在途区间的槽位
+    //
+    // 仅由持有者写入, 读者(dump)通过序列号获得 start/end 一致的视图:
+    // 序列号为奇数表示正在更新, 读取前后序列号不变则视图有效.
+    // position 只会单调递增, 可以随时读取.
+    struct Slot {
+        std::atomic<uint32_t> sequence = 0;
+        std::atomic<bool>     busy     = false;
+        std::atomic<int64_t>  start    = -1;
+        std::atomic<int64_t>  end      = -1;
+        std::atomic<int64_t>  position = 0;
+        std::atomic<int>      twin       = -1;    // 对冲的对端槽位, 由 _mutex 保护
+        std::atomic<bool>     superseded = false; // 对端已完成了剩余的部分
+    };
+
+    // 已完成区间的发布视图, 仅在没有读者时由持有 _mutex 的写者改写
+    struct FinishedView {
+        std::vector<Range>    ranges;
+        uint64_t              epoch   = 0;
+        std::atomic<int>      readers = 0;
+    };
+
+    static constexpr int kSlotCapacity = 512; // 在途区间的上限, 即最大并发连接数
+
+    std::filesystem::path        _filename;
+    std::shared_ptr<RangeStorage> _storage;             // 存储后端, 为空时打开磁盘文件
+    mutable std::mutex           _mutex;
+    mutable std::mutex           _mutexFile;
+    mutable std::mutex           _mutexMeta;
+
+    bool                         _durable        = false;
+    bool                         _openEnded      = false;
+    bool                         _stream         = false;
+    std::string                  _validator;            // 顺序模式下续传的校验符
+    int64_t                      _blockHint      = 0x100000;
+    int64_t                      _bytesTotal     = -1;
+    std::atomic<int64_t>         _bytesProcessed = 0;
+    std::atomic<int64_t>         _bytesFinished  = 0;
+
+    std::vector<Range>           _queue;                // 待分配的区间, 构建后只读
+    std::vector<size_t>          _lanes;                // 各个通道在队列中的起始索引, 末尾为队列的长度, 构建后只读
+    std::unique_ptr<std::atomic<size_t>[]> _cursors;    // 各个通道下一个待分配区间的索引
+    std::shared_ptr<RangePolicy> _policy;               // 分配策略, 为空时顺序分配
+    int                          _laneCount = 1;        // 通道数, 即连接数
+    std::atomic<bool>            _queueReady  = false;
+    std::pmr::unsynchronized_pool_resource _pool;      // 区间集合的节点池, 释放的节点留待复用, 由 _mutex 保护
+    RangeSet                     _finishedRanges{ &_pool }; // 已完成的区间, 由 _mutex 保护
+    RangeSet                     _availableRanges{ &_pool }; // 归还的区间, 由 _mutex 保护
+    std::vector<Range>           _skips;                // insert_available() 的临时缓冲, 由 _mutex 保护
+    std::atomic<size_t>          _availableCount = 0;   // 归还区间的数量, 避免无谓的加锁
+    std::unique_ptr<Slot[]>      _slots;
+    std::atomic<int>             _slotHint = 0;
+    uint64_t                     _epoch = 0;            // 已完成区间的版本, 由 _mutex 保护
+    mutable FinishedView         _views[2];
+    mutable std::atomic<int>     _view = 0;             // 当前发布的视图
+    mutable std::atomic<bool>    _viewDirty = false;    // 存在尚未发布的变化
+
+#ifdef RANGE_FILE_STATISTICS
+    mutable RangeFileStatistics  _statistics;
+
+    template<class Mutex>
+    std::unique_lock<Mutex> lock(Mutex& mutex) const {
+        std::unique_lock<Mutex> locker(mutex, std::try_to_lock);
+        if (!locker.owns_lock()) {
+            auto start = std::chrono::steady_clock::now();
+            locker.lock();
+            _statistics.lockContended++;
+            _statistics.lockWaitNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+        _statistics.lockAcquires++;
+        return locker;
+    }
+#else
+    template<class Mutex>
+    std::unique_lock<Mutex> lock(Mutex& mutex) const {
+        return std::unique_lock<Mutex>(mutex);
     }
+#endif
 
-    bool valid() {
-        auto size = 0LL;
-        for (auto const& r : _finishedRanges)
-            size += r.size();
+    // 按 _blockHint 切分未完成的区间, 构建待分配队列
+    void build_queue()
+    {
+        if (_queueReady.load(std::memory_order_acquire))
+            return;
+
+        auto locker = lock(_mutex);
+        if (_queueReady.load(std::memory_order_relaxed))
+            return;
+
+        if (_availableRanges.empty() && _finishedRanges.empty())
+            _availableRanges.insert({ 0, _bytesTotal - 1 });
+
+        _queue.clear();
+        _lanes.clear();
         for (auto const& r : _availableRanges)
-            size += r.size();
-        for (auto const& r : _allocateRanges)
-            size += r.size();
-        return size == _bytesTotal;
+        {
+            if (_openEnded) { // 整个区间交给一个连接, 其余的连接通过拆分加入
+                _queue.push_back({ r.start, r.end });
+                continue;
+            }
+
+            Range last = { r.start, r.start - 1 };
+            while (last.end < r.end)
+            {
+                last.start = last.end + 1;
+                last.end = std::min(last.start + _blockHint - 1, r.end);
+                _queue.push_back(last);
+
+                util_assert(last.size() <= _blockHint);
+            }
+        }
+        _availableRanges.clear();
+        _availableCount = 0;
+
+        if (_policy)
+            _lanes = _policy->arrange(_queue, _laneCount);
+        if (_lanes.size() < 2)
+            _lanes = { 0, _queue.size() };
+        util_assert(_lanes.front() == 0 && _lanes.back() == _queue.size());
+        _cursors.reset(new std::atomic<size_t>[_lanes.size() - 1]);
+        for (size_t i = 0; i + 1 < _lanes.size(); ++i)
+            _cursors[i] = _lanes[i];
+        _queueReady.store(true, std::memory_order_release);
+
+        NLOG_PRO("allocate() calculate the available range of the file: ");
+        NLOG_PRO(" - block-hint: ") << _blockHint;
+        NLOG_PRO(" - bytes-total: ") << _bytesTotal;
+        NLOG_PRO(" - available-ranges: ") << _queue.size();
+        NLOG_PRO(" - lanes: ") << _lanes.size() - 1;
+    }
+
+    // 无锁的从队列中取出区间, 优先使用连接自己的通道, 耗尽后从剩余最多的通道中取
+    bool pop_queue(int lane, Range& range)
+    {
+        const size_t count = _lanes.size() - 1;
+        size_t k = lane >= 0 ? size_t(lane) % count : 0;
+        while (true)
+        {
+            auto index = _cursors[k].fetch_add(1, std::memory_order_relaxed);
+            if (index < _lanes[k + 1]) {
+                range = _queue[index];
+                return true;
+            }
+
+            size_t most = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto cursor = _cursors[i].load(std::memory_order_relaxed);
+                if (cursor < _lanes[i + 1] && _lanes[i + 1] - cursor > most) {
+                    most = _lanes[i + 1] - cursor;
+                    k = i;
+                }
+            }
+            if (most == 0)
+                return false;
+        }
+    }
+
+    // 队列是否已全部分配
+    bool queue_exhausted() const
+    {
+        for (size_t i = 0; i + 1 < _lanes.size(); ++i) {
+            if (_cursors[i].load(std::memory_order_relaxed) < _lanes[i + 1])
+                return false;
+        }
+        return true;
     }
-};
 
-namespace boost {
-    namespace serialization {
-        template<class Archive>
-        void serialize(Archive& ar, Range2& d, const unsigned int version) {
-            ar & d.start;
-            ar & d.end;
-            ar & d.position;
-            ar & d.state;
+    int acquire_slot()
+    {
+        int hint = _slotHint.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0; i < kSlotCapacity; ++i)
+        {
+            int index = (hint + i) % kSlotCapacity;
+            bool expected = false;
+            if (!_slots[index].busy.load(std::memory_order_relaxed) &&
+                _slots[index].busy.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return index;
         }
+        return -1;
+    }
+
+    void publish_slot(int index, const Range2& range)
+    {
+        auto& slot = _slots[index];
+        slot.sequence.fetch_add(1, std::memory_order_acq_rel);
+        slot.start.store(range.start, std::memory_order_relaxed);
+        slot.end.store(range.end, std::memory_order_relaxed);
+        slot.position.store(range.position, std::memory_order_relaxed);
+        slot.sequence.fetch_add(1, std::memory_order_release);
+    }
 
-        template<class Archive>
-        void serialize(Archive& ar, RangeFileMeta& d, const unsigned int version) {
-            ar & d._blockHint;
-            ar & d._bytesTotal;
-            ar & d._bytesProcessed;
-            ar & d._allocateRanges;
-            ar & d._finishedRanges;
-            ar & d._availableRanges;
+    void release_slot(int index)
+    {
+        publish_slot(index, Range2{});
+        _slots[index].twin.store(-1, std::memory_order_relaxed);
+        _slots[index].superseded.store(false, std::memory_order_relaxed);
+        _slots[index].busy.store(false, std::memory_order_release);
+    }
+
+    // 读取槽位的一致视图, 槽位空闲时返回无效区间
+    Range2 read_slot(int index) const
+    {
+        auto& slot = _slots[index];
+        while (true)
+        {
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            Range2 range;
+            range.start = slot.start.load(std::memory_order_relaxed);
+            range.end = slot.end.load(std::memory_order_relaxed);
+            range.position = slot.position.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+                continue;
+
+            range.state = range.position == range.start ? Range2::kPending : Range2::kPartial;
+            range.slot = index;
+            return range;
         }
-    } // namespace serialization
-} // boost
+    }
 
-// 区间化文件实现
-// 
-// 1. 分配未使用区间
-//      需要防止重复分配, 需要记录正在使用的未决区间, 完毕(成功填充, 部分填充, 未填充)后移除
-// 1. 区间填充时, 会将数据写入文件, 填充位置记录到区间状态中
-// 1. 区间完毕后, 记录已经填充的区间, 部分填充的区间则需要缩小
+    static int64_t Overlap(const Range& a, const Range& b) {
+        return std::max<int64_t>(std::min(a.end, b.end) - std::max(a.start, b.start) + 1, 0);
+    }
 
-class RangeFile : public RangeFileMeta
-{
-    std::filesystem::path _filename;
-    util::ffile           _file;
-    std::recursive_mutex  _mutex;
-    std::mutex            _mutexFile;
-    std::mutex            _mutexMeta;
+    // 插入已完成的区间, 仅与相邻的区间合并, 需持有 _mutex
+    // @return 新增的字节数, 与已完成的区间重叠的部分(对冲的重复数据)不计入
+    int64_t insert_finished(Range2 range)
+    {
+        const Range origin = { range.start, range.end };
+        int64_t overlap = 0;
+        range.position = range.end + 1;
+        range.state = Range2::kFilled;
+
+        auto it = _finishedRanges.lower_bound(range);
+        if (it != _finishedRanges.begin() && std::prev(it)->mergeable(range)) {
+            --it;
+            overlap += Overlap(*it, origin);
+            range.start = it->start;
+            range.end = std::max(range.end, it->end);
+            it = _finishedRanges.erase(it);
+        }
+        while (it != _finishedRanges.end() && it->mergeable(range)) {
+            overlap += Overlap(*it, origin);
+            range.end = std::max(range.end, it->end);
+            it = _finishedRanges.erase(it);
+        }
+        range.position = range.end + 1;
+        _finishedRanges.insert(it, range);
+        publish_finished();
+        return origin.size() - overlap;
+    }
+
+    // 已完成的区间发生了变化, 需持有 _mutex
+    void publish_finished()
+    {
+        ++_epoch;
+        flush_finished();
+    }
+
+    // 将已完成的区间复制到备用的视图并切换, 需持有 _mutex
+    // 复用视图的容量, 稳定后不再分配内存; 备用的视图仍有读者时标记为未发布
+    void flush_finished() const
+    {
+        int spare = 1 - _view.load(std::memory_order_relaxed);
+        auto& view = _views[spare];
+        if (view.readers.load() > 0) {
+            _viewDirty.store(true, std::memory_order_release);
+            return;
+        }
+
+        view.ranges.clear();
+        for (auto const& r : _finishedRanges)
+            view.ranges.push_back({ r.start, r.end });
+        view.epoch = _epoch;
+        _view.store(spare);
+        _viewDirty.store(false, std::memory_order_release);
+    }
+
+    // 固定当前发布的视图, 之后由 unpin_view() 释放
+    // 计数之后须再次确认视图仍是当前的, 否则写者可能已在计数之前检查过并开始改写
+    FinishedView& pin_view() const
+    {
+        while (true)
+        {
+            int index = _view.load();
+            _views[index].readers.fetch_add(1);
+            if (_view.load() == index)
+                return _views[index];
+            _views[index].readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    void unpin_view(FinishedView& view) const {
+        view.readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    // 记录在途区间已填充的部分, 扣除对端已经完成的重复数据, 需持有 _mutex
+    void finish_range(const Range& range)
+    {
+        auto added = insert_finished({ range.start, range.end });
+        _bytesFinished += added;
+        if (added < range.size())
+            _bytesProcessed -= range.size() - added;
+    }
+
+    // 归还未填充的区间, 跳过已完成的以及仍由对端负责的部分, 需持有 _mutex
+    void insert_available(const Range& range, const Range& exclude)
+    {
+        auto& skips = _skips;
+        skips.clear();
+        if (exclude.valid())
+            skips.push_back(exclude);
+        auto it = _finishedRanges.upper_bound(Range2{ range.start, range.start });
+        if (it != _finishedRanges.begin())
+            --it;
+        for (; it != _finishedRanges.end() && it->start <= range.end; ++it)
+            skips.push_back({ it->start, it->end });
+        std::sort(skips.begin(), skips.end());
+
+        auto next = range.start;
+        auto insert = [&](int64_t end) {
+            if (next <= end) {
+                _availableRanges.insert({ next, end });
+                _availableCount.fetch_add(1, std::memory_order_release);
+            }
+        };
+        for (auto const& r : skips)
+        {
+            if (r.end < next)
+                continue;
+            if (r.start > range.end)
+                break;
+            insert(r.start - 1);
+            next = r.end + 1;
+        }
+        insert(range.end);
+    }
+
+    // 区间填充完毕, 若对端剩余的部分已被覆盖则通知其中止
+    void supersede_twin(const Range2& range)
+    {
+        auto locker = lock(_mutex);
+        int twin = _slots[range.slot].twin.load(std::memory_order_relaxed);
+        if (twin < 0)
+            return;
+        auto other = read_slot(twin);
+        if (other.valid() && other.position >= range.start && other.end <= range.end)
+            _slots[twin].superseded.store(true, std::memory_order_release);
+    }
+
+    // 区间状态的快照, 未完成且不在途的部分均视为待分配
+    RangeFileMeta snapshot() const
+    {
+        RangeFileMeta meta;
+        meta._blockHint = _blockHint;
+        meta._bytesTotal = _bytesTotal;
+        meta._bytesProcessed = _bytesProcessed;
+        if (_stream)
+        {
+            meta._stream = true;
+            {
+                auto locker = lock(_mutex);
+                meta._validator = _validator;
+            }
+            if (meta._bytesProcessed > 0)
+                meta._finishedRanges.insert({ 0, meta._bytesProcessed - 1, meta._bytesProcessed, Range2::kFilled });
+            return meta;
+        }
+
+        RangeProgress progress;
+        this->progress(progress);
+        for (auto const& r : progress.finished)
+            meta._finishedRanges.insert({ r.start, r.end, r.end + 1, Range2::kFilled });
+        meta._allocateRanges.insert(progress.inflight.begin(), progress.inflight.end());
+        for (auto const& r : progress.available)
+            meta._availableRanges.insert({ r.start, r.end });
+        return meta;
+    }
 
 public:
-    RangeFile(int64_t size = -1, int sizeHint = 0x100000) {
+    RangeFile(int64_t size = -1, int sizeHint = 0x100000)
+        : _slots(new Slot[kSlotCapacity]) {
         _blockHint  = sizeHint;
         _bytesTotal = size;
     }
 
     ~RangeFile() {
+        std::error_code ecode;
         if (valid())
-            close(false, std::error_code{});
+            close(false, ecode);
     }
 
     operator bool() const {
@@ -127,126 +478,303 @@ public:
     }
 
     bool valid() const {
-        return _file;
+        return _storage && _storage->valid();
     }
 
     // 文件已经打开 或 已经分配了区域, 则不能再指派大小
     bool reserve(int64_t size = -1, int sizeHint = 0x100000) {
-        if (valid() || 
-            _finishedRanges.size() ||
-            _allocateRanges.size()) {
+        if (valid() || _queueReady || _bytesFinished > 0)
             return false;
-        }
         _blockHint = sizeHint;
         _bytesTotal = size;
         return true;
     }
 
+    //! 指定存储后端, 须在 open() 之前, close() 之后恢复为磁盘文件
+    bool set_storage(std::shared_ptr<RangeStorage> storage) {
+        if (valid())
+            return false;
+        _storage = std::move(storage);
+        return true;
+    }
+
+    //! 持久模式: 检查点及完成时将数据同步到磁盘
+    void set_durable(bool durable) {
+        _durable = durable;
+    }
+
+    //! 开放区间模式: 按未完成的区间而不是 _blockHint 分配, 没有可分配的区间时由 split() 拆分在途区间
+    void set_open_ended(bool openEnded) {
+        _openEnded = openEnded;
+    }
+
+    //! 分配策略: 构建待分配队列时由策略排列并划分通道
+    //! @param lanes 通道数, 即连接数, allocate() 以连接的序号选择通道
+    void set_policy(std::shared_ptr<RangePolicy> policy, int lanes) {
+        _policy = std::move(policy);
+        _laneCount = std::max(lanes, 1);
+    }
+
+    //! 顺序模式: 数据从头开始连续写入, 长度可以未知, 检查点记录已写入的长度以便续传
+    void set_stream(bool stream) {
+        _stream = stream;
+    }
+
+    //! 顺序模式下续传的校验符, 随检查点保存, 续传时用于 If-Range
+    //! 检查点可能在其他线程中读取
+    void set_validator(const std::string& validator) {
+        auto locker = lock(_mutex);
+        _validator = validator;
+    }
+
+    const std::string& validator() const {
+        return _validator;
+    }
+
     // 分配区域并保证不相交
-    bool allocate(Range2& range)
+    // @param lane 连接的通道, 即连接的序号
+    bool allocate(Range2& range, int lane = 0)
     {
         if (_bytesTotal <= 0)
             return {};
 
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
-        if (_availableRanges.empty() && 
-            _allocateRanges.empty() && 
-            _finishedRanges.empty())
-        {
-            Range2 last = { 0, 0, 0, Range2::kUnfilled };
-            do
-            {
-                last.start = last.end > 0 ? last.end + 1 : 0;
-                last.end = std::min(last.start + _blockHint - 1, _bytesTotal - 1);
-                _availableRanges.insert(last);
+        build_queue();
 
-                util_assert(last.size() <= _blockHint);
-            } 
-            while (last.end < (_bytesTotal - 1));
+        int slot = acquire_slot();
+        if (slot < 0) {
+            NLOG_WAR("allocate() exceeds the slot capacity: ") << kSlotCapacity;
+            return false;
+        }
 
-            NLOG_PRO("allocate() calculate the available range of the file: ");
-            NLOG_PRO(" - block-hint: ") << _blockHint;
-            NLOG_PRO(" - bytes-total: ") << _bytesTotal;
-            NLOG_PRO(" - available-ranges: ") << _availableRanges.size();
+        // 没有归还的区间时, 无锁的从队列中分配
+        Range next;
+        if (_availableCount.load(std::memory_order_acquire) == 0)
+        {
+            if (pop_queue(lane, next))
+            {
+                range = { next.start, next.end, next.start, Range2::kPending, slot };
+                util_assert(_openEnded || range.size() <= _blockHint);
+                publish_slot(slot, range);
+                return true;
+            }
         }
 
+        auto locker = lock(_mutex);
         if (_availableRanges.size() > 0)
         {
-            range = *_availableRanges.begin();
-            range.state = Range2::kPending;
-            range.position = range.start;
-            util_assert(range.size() <= _blockHint);
+            auto it = _policy ? _policy->pick(_availableRanges, lane) : _availableRanges.begin();
+            range = { it->start, it->end, it->start, Range2::kPending, slot };
+            util_assert(_openEnded || range.size() <= _blockHint);
+
+            _availableRanges.erase(it);
+            _availableCount.fetch_sub(1, std::memory_order_release);
+            publish_slot(slot, range);
+            return true;
+        }
 
-            _allocateRanges.insert(range);
-            _availableRanges.erase(_availableRanges.begin());
+        // 队列仍有剩余 (与归还的区间竞争时跳过了队列)
+        if (pop_queue(lane, next))
+        {
+            range = { next.start, next.end, next.start, Range2::kPending, slot };
+            publish_slot(slot, range);
             return true;
         }
 
+        release_slot(slot);
         return false;
     }
 
+    //! 拆分: 没有可分配的区间时, 将剩余最多的在途区间的后半部分分配给新的连接
+    //! @param minimum 拆分出的区间不小于该字节数
+    //! @return 没有可拆分的区间时返回 false
+    bool split(Range2& range, int64_t minimum)
+    {
+        if (_bytesTotal <= 0 || !_queueReady.load(std::memory_order_acquire))
+            return false;
+        if (_availableCount.load(std::memory_order_acquire) > 0 || !queue_exhausted())
+            return false;
+
+        int slot = acquire_slot();
+        if (slot < 0)
+            return false;
+
+        auto locker = lock(_mutex);
+        Range2 target;
+        for (int i = 0; i < kSlotCapacity; ++i)
+        {
+            // 对冲中的区间由双方竞争, 不再拆分
+            if (i == slot || !_slots[i].busy.load(std::memory_order_acquire) ||
+                _slots[i].twin.load(std::memory_order_relaxed) >= 0)
+                continue;
+            auto r = read_slot(i);
+            if (!r.valid() || r.end - r.position + 1 < std::max<int64_t>(minimum, 1) * 2)
+                continue;
+            if (!target.valid() || r.end - r.position > target.end - target.position)
+                target = r;
+        }
+
+        if (!target.valid()) {
+            release_slot(slot);
+            return false;
+        }
+
+        // 持有者仍在写入, 拆分点之前至少留有 minimum 字节, 越过拆分点的部分由持有者在填充时扣除
+        auto middle = target.position + (target.end - target.position + 1) / 2;
+        auto& owner = _slots[target.slot];
+        owner.sequence.fetch_add(1, std::memory_order_acq_rel);
+        owner.end.store(middle - 1, std::memory_order_release);
+        owner.sequence.fetch_add(1, std::memory_order_release);
+
+        range = { middle, target.end, middle, Range2::kPending, slot };
+        publish_slot(slot, range);
+
+        NLOG_PRO("split() range: {1}")
+            % util::sformat("[%08" PRIx64 ", %08" PRIx64 "] -> [%08" PRIx64 ", %08" PRIx64 "]",
+                target.start, target.end, range.start, range.end);
+        return true;
+    }
+
+    //! 以槽位为准更新区间的结束位置: 区间可能已被拆分而缩短, 越过拆分点的部分不再计入
+    void clip(Range2& range)
+    {
+        if (range.slot < 0 || range.slot >= kSlotCapacity)
+            return;
+        auto end = _slots[range.slot].end.load(std::memory_order_acquire);
+        if (end < range.start || end >= range.end)
+            return;
+
+        range.end = end;
+        if (range.position > end + 1)
+        {
+            // 重复的数据由拆分出的区间再次写入并计数
+            _bytesProcessed.fetch_sub(range.position - (end + 1), std::memory_order_relaxed);
+            range.position = end + 1;
+            _slots[range.slot].position.store(range.position, std::memory_order_release);
+        }
+        if (range.position == end + 1)
+            range.state = Range2::kFilled;
+    }
+
+    //! 对冲: 没有可分配的区间时, 重新请求在途区间中剩余最多的未填充后缀
+    //! @param minimum 剩余不足该字节数的区间不值得对冲
+    //! @return 没有可对冲的区间时返回 false
+    bool hedge(Range2& range, int64_t minimum)
+    {
+        if (_bytesTotal <= 0 || !_queueReady.load(std::memory_order_acquire))
+            return false;
+        if (_availableCount.load(std::memory_order_acquire) > 0 || !queue_exhausted())
+            return false;
+
+        int slot = acquire_slot();
+        if (slot < 0)
+            return false;
+
+        auto locker = lock(_mutex);
+        Range2 target;
+        for (int i = 0; i < kSlotCapacity; ++i)
+        {
+            // 每个区间同时只有一个对冲, 已被对端完成的区间正在中止
+            if (i == slot || !_slots[i].busy.load(std::memory_order_acquire) ||
+                _slots[i].twin.load(std::memory_order_relaxed) >= 0 ||
+                _slots[i].superseded.load(std::memory_order_relaxed))
+                continue;
+            auto r = read_slot(i);
+            if (!r.valid() || r.end - r.position + 1 < std::max<int64_t>(minimum, 1))
+                continue;
+            if (!target.valid() || r.end - r.position > target.end - target.position)
+                target = r;
+        }
+
+        if (!target.valid()) {
+            release_slot(slot);
+            return false;
+        }
+
+        range = { target.position, target.end, target.position, Range2::kPending, slot };
+        publish_slot(slot, range);
+        _slots[slot].twin.store(target.slot, std::memory_order_relaxed);
+        _slots[target.slot].twin.store(slot, std::memory_order_relaxed);
+
+        NLOG_PRO("hedge() range: {1}")
+            % util::sformat("[%08" PRIx64 ", %08" PRIx64 "]", range.start, range.end);
+        return true;
+    }
+
+    //! 区间的剩余部分已由对冲的对端完成, 应当中止
+    bool superseded(const Range2& range) const {
+        return range.slot >= 0 && range.slot < kSlotCapacity &&
+            _slots[range.slot].superseded.load(std::memory_order_acquire);
+    }
+
     bool deallocate(Range2& range)
     {
         util_assert(range.valid());
         util_assert(range.state != Range2::kUnfilled);
 
-        auto mergeRanges = [](auto& ranges) {
-            std::remove_reference<decltype(ranges)>::type duplicate;
-            Range2 last;
-            for (const auto& r : ranges) {
-                util::scope_exit _exit = [&] { last = r; };
-                if (!last.valid())
-                    continue;
-
-                if (last.mergeable(r))
-                {
-                    _exit.reset();
-                    last = {last + r, std::max(last.position, r.position), last.state};
-                    continue;
-                }
-                duplicate.insert(last);
-            }
-            duplicate.insert(last);
-
-            util_assert(!duplicate.empty());
-            if (ranges.size() != duplicate.size())
-                ranges = std::move(duplicate);
-        };
+        if (range.slot < 0 || range.slot >= kSlotCapacity)
+            return false;
 
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
-        auto it = _allocateRanges.find(range);
-        if (it == _allocateRanges.end())
+        auto locker = lock(_mutex);
+        if (!_slots[range.slot].busy || _slots[range.slot].start != range.start)
             return false;
+        clip(range);
+
+        // 对端仍在途, 其覆盖的部分由对端负责, 不再归还
+        Range exclude;
+        int twin = _slots[range.slot].twin.load(std::memory_order_relaxed);
+        if (twin >= 0)
+        {
+            auto other = read_slot(twin);
+            exclude = { other.start, other.end };
+        }
 
-        _allocateRanges.erase(it);
+        bool result = true;
         switch (range.state)
         {
         case Range2::kPending:
-            _availableRanges.insert({ range.start, range.end });
-            return true;
+            insert_available({ range.start, range.end }, exclude);
+            break;
 
         case Range2::kFilled:
             util_assert(range.position == (range.end + 1));
-            _finishedRanges.insert(range);
-            mergeRanges(_finishedRanges);
-            return true;
+            finish_range({ range.start, range.end });
+            break;
 
         case Range2::kPartial:
             util_assert(range.start <= range.position && range.position <= range.end);
-            _finishedRanges.insert({ range.start, range.position - 1, range.position - 1, Range2::kFilled });
-            _availableRanges.insert({ range.position, range.end });
-            mergeRanges(_finishedRanges);
-            return true;
+            finish_range({ range.start, range.position - 1 });
+            insert_available({ range.position, range.end }, exclude);
+            break;
+
+        default:
+            result = false;
+            break;
         }
 
-        return false;
+        // 不使用 util_scope_exit: 其捕获较多时会分配堆内存, 而这里每个区间都会经过
+        if (twin >= 0)
+            _slots[twin].twin.store(-1, std::memory_order_relaxed);
+        release_slot(range.slot);
+        range.slot = -1;
+        return result;
     }
 
     bool open(const std::filesystem::path& filename, std::error_code& error)
     {
         error.clear();
+        if (!_storage)
+            _storage = std::make_shared<FileStorage>();
         try
         {
+            // 不持久的存储没有临时文件及元数据, 总是从头开始
+            if (!_storage->persistent())
+            {
+                _storage->open(filename);
+                _storage->resize(std::max<int64_t>(_bytesTotal, 0));
+                _filename = filename;
+                return true;
+            }
+
             if (filename.has_parent_path())
             {
                 std::error_code ecode;
@@ -258,22 +786,56 @@ public:
 
             auto temp = std::filesystem::path(filename) += L".temp";;
             auto meta = std::filesystem::path(filename) += L".meta";
-            auto file = util::file_open(temp, O_CREAT | O_RDWR);
-            auto size = util::file_size(file);
+            auto size = _storage->open(temp);
 
-            // 文件总大小有效, 则文件被设置为同等大小.
-            // 文件总大小无效, 则文件被截断为0.
-            if (size != _bytesTotal)
+            if (_stream)
             {
-                util::file_seek(file, std::max<int64_t>(_bytesTotal, 0), 0);
+                // 顺序模式: 上一次的进度有效时从已写入的末尾继续, 否则从头开始.
+                // 未知长度时只有存在校验符才续传, 以便服务器通过 If-Range 确认内容没有改变
+                int64_t written = 0;
+                RangeFileMeta archive = {};
+                try
+                {
+                    if (util::file_exist(meta) && LoadRangeMeta(meta, archive) && archive._stream &&
+                        archive._bytesTotal == _bytesTotal && archive._bytesProcessed <= size &&
+                        (!archive._validator.empty() || _bytesTotal > 0))
+                        written = archive._bytesProcessed;
+                }
+                catch (const std::exception& e)
+                {
+                    NLOG_WAR("open({1}) failed to synchronize metadata, error: {2}")
+                        % meta.wstring()
+                        % e.what();
+                }
 
-                // If the function succeeds, the return value is nonzero.
-                // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-setendoffile
-                //
-                if (SetEndOfFile((HANDLE)file.native_id()) == 0)
-                    throw util::ferror(::GetLastError(), "SetEndOfFile() failed");
+                if (written > 0)
+                {
+                    NLOG_PRO("open() Restore the previous stream, written: {1}, validator: {2}")
+                        % written
+                        % archive._validator;
+
+                    auto locker = lock(_mutex);
+                    _bytesProcessed = written;
+                    _bytesFinished = written;
+                    _finishedRanges.clear();
+                    _finishedRanges.insert(archive._finishedRanges.begin(), archive._finishedRanges.end());
+                    publish_finished();
+                    _validator = std::move(archive._validator);
+                }
+                else
+                {
+                    util::ferror ferr;
+                    if (util::file_exist(meta, ferr))
+                        util::file_remove(meta, ferr);
+                }
 
-                util::file_seek(file, 0, 0);
+                _storage->resize(_bytesTotal > 0 ? _bytesTotal : written);
+            }
+            // 文件总大小有效, 则文件被设置为同等大小.
+            // 文件总大小无效, 则文件被截断为0.
+            else if (size != _bytesTotal)
+            {
+                _storage->resize(std::max<int64_t>(_bytesTotal, 0));
 
                 // 调整了文件大小, 则尝试删除可能的元数据文件, 并忽略错误
                 util::ferror ferr;
@@ -286,52 +848,54 @@ public:
                 {
                     // 大小有效 且 文件大小没有被调整, 尝试打开同步上一次的元数据
                     RangeFileMeta archive = {};
+                    bool loaded = false;
                     try
                     {
-                        std::ifstream is(meta, std::ios::binary);
-                        boost::archive::binary_iarchive ia(is);
-                        ia >> archive;
+                        loaded = LoadRangeMeta(meta, archive);
                     }
                     catch (const std::exception& e)
                     {
                         NLOG_WAR("open({1}) failed to synchronize metadata, error: {2}")
                             % meta.wstring()
                             % e.what();
-                        util::file_remove(meta);
                     }
 
-                    if (archive._blockHint == _blockHint &&
-                        archive._bytesTotal == _bytesTotal)
+                    if (!loaded)
                     {
-                        // 恢复状态的话, 先用简单方案处理: 暴力的丢弃所有正在处理的区间
-                        for (auto r : archive._allocateRanges) {
-                            archive._availableRanges.insert({ r.start, r.end });
-                            archive._bytesProcessed -= (r.position - r.start);
-                        }
-                        archive._allocateRanges.clear();
-
-                        NLOG_PRO("open() Restore the previous status:");
+                        NLOG_ERR("open() drop the invalid status");
+                        util::ferror ferr;
+                        util::file_remove(meta, ferr);
+                    }
+                    else if (archive._bytesTotal == _bytesTotal)
+                    {
+                        NLOG_PRO("open() Restore the previous status, block-hint: {1} -> {2}")
+                            % archive._blockHint
+                            % _blockHint;
                         archive.trace();
 
-                        if (archive.valid())
-                        {
-                            std::lock_guard<std::recursive_mutex> locker(_mutex);
-                            _bytesProcessed = archive._bytesProcessed;
-                            _finishedRanges = std::move(archive._finishedRanges);
-                            _availableRanges = std::move(archive._availableRanges);
-                        }
-                        else {
-                            NLOG_ERR("open() drop the invalid status");
-                        }
+                        // 状态只是字节区间, 与分块大小无关, 未完成的部分在首次分配时按当前的 _blockHint 重新切分
+                        auto locker = lock(_mutex);
+                        _bytesProcessed = archive._bytesProcessed;
+                        _bytesFinished = archive._bytesProcessed;
+                        _finishedRanges.clear();
+                        _availableRanges.clear();
+                        _finishedRanges.insert(archive._finishedRanges.begin(), archive._finishedRanges.end());
+                        _availableRanges.insert(archive._availableRanges.begin(), archive._availableRanges.end());
+
+                        // 顺序模式的元数据只记录已写入的长度, 未写入的尾部即是待分配的区间
+                        if (archive._stream && archive._bytesProcessed < _bytesTotal)
+                            _availableRanges.insert({ archive._bytesProcessed, _bytesTotal - 1 });
+                        publish_finished();
                     }
                 }
             }
 
-            _file = file;
             _filename = filename;
         }
         catch (const util::ferror& ferr)
         {
+            if (_storage->valid())
+                _storage->close();
             NLOG_ERR("open({1}) failed, error: {2}")
                 % _filename.wstring()
                 % ferr.message();
@@ -345,11 +909,23 @@ public:
     {
         error.clear();
 
-        util_assert(_file);
-        util_assert(_allocateRanges.empty());
+        util_assert(valid());
         {
-            std::lock_guard<std::mutex> locker(_mutexFile);
-            _file.close();
+            auto locker = lock(_mutexFile);
+            if (finished && _durable)
+            {
+                try {
+                    _storage->sync();
+                }
+                catch (const util::ferror& ferr) {
+                    NLOG_ERR("close({1}) failed to sync, error: {2}")
+                        % _filename.wstring()
+                        % ferr.message();
+                    _storage->close();
+                    return !(error = util::MakeErrorFromNative(ferr.code(), _filename, util::kFilesystemError));
+                }
+            }
+            _storage->close();
         }
 
         if (finished)
@@ -365,12 +941,15 @@ public:
             auto file = _filename;
             try
             {
-                file += ".temp";
-                util::file_move(file, _filename);
+                if (_storage->persistent())
+                {
+                    file += ".temp";
+                    util::file_move(file, _filename);
 
-                file =  _filename;
-                file += ".meta";
-                util::file_remove(file);
+                    file =  _filename;
+                    file += ".meta";
+                    util::file_remove(file);
+                }
             }
             catch (const util::ferror& ferr)
             {
@@ -382,15 +961,30 @@ public:
         }
 
         {
-            std::lock_guard<std::recursive_mutex> locker(_mutex);
-            _allocateRanges.clear();
+            auto locker = lock(_mutex);
+            _queue.clear();
+            _lanes.clear();
             _finishedRanges.clear();
             _availableRanges.clear();
+            publish_finished();
+            for (int i = 0; i < kSlotCapacity; ++i)
+                util_assert(!_slots[i].busy);
         }
+        _queueReady = false;
+        _cursors.reset();
+        _policy.reset();
+        _laneCount = 1;
+        _availableCount = 0;
+        _durable = false;
+        _openEnded = false;
+        _stream = false;
+        _validator.clear();
         _blockHint = 0x100000;
         _bytesTotal = -1;
         _bytesProcessed = 0;
+        _bytesFinished = 0;
         _filename.clear();
+        _storage.reset();
 
         return !error;
     }
@@ -398,33 +992,59 @@ public:
     bool dump(std::error_code& error)
     {
         error.clear();
+        if (_bytesTotal <= 0 && !_stream) // 未知大小, 没有可记录的区间
+            return true;
+        if (_storage && !_storage->persistent()) // 没有可续传的数据
+            return true;
+
+        MetricTimer timer(Metrics::Instance().checkpoint);
         try
         {
+            RangeFileMeta archive = snapshot();
 #if IS_DEBUG
-            if (!RangeFileMeta::valid()) {
+            if (!archive._stream && !archive.valid()) {
                 NLOG_PRO("dump() invalid status:");
-                trace();
+                archive.trace();
             }
 #endif
 
-            RangeFileMeta archive = {};
-            {
-                std::lock_guard<std::recursive_mutex> locker(_mutex);
-                archive = *static_cast<RangeFileMeta*>(this);
-            }
-
             try
             {
                 auto meta = std::filesystem::path(_filename) += L".meta";
                 auto temp = std::filesystem::path(_filename) += L".meta.temp";
-                std::lock_guard<std::mutex> locker(_mutexMeta);
+                auto bytes = EncodeRangeMeta(archive);
+                auto locker = lock(_mutexMeta);
+
+                // 快照之前写入的数据, 须先于元数据落盘
+                // 一次同步覆盖两次检查点之间的所有写入, 工作线程无需等待
+                // 同步与写入可以并发, 锁外同步, 顺序填充不必等待检查点
+                if (_durable)
                 {
-                    std::ofstream os(temp, std::ios::binary | std::ios::trunc);
-                    boost::archive::binary_oarchive oa(os);
-                    oa << archive;
+                    std::shared_ptr<RangeStorage> storage;
+                    {
+                        auto locker = lock(_mutexFile);
+                        if (valid())
+                            storage = _storage;
+                    }
+                    if (storage)
+                        storage->sync();
                 }
-                util::file_remove(meta);
-                util::file_move(temp, meta);
+
+                {
+                    auto file = util::file_open(temp, O_CREAT | O_RDWR | O_TRUNC);
+                    util_scope_exit = [&] { file.close(); };
+                    util::file_write(file, bytes.data(), (int64_t)bytes.size());
+                    if (_durable)
+                        RangeFileSync(file);
+                }
+
+                // 原子的替换, 任意时刻磁盘上都存在一份完整的元数据
+                std::error_code ecode;
+                std::filesystem::rename(temp, meta, ecode);
+                if (ecode)
+                    throw util::ferror(ecode.value(), "rename() failed");
+                if (_durable)
+                    RangeFileSyncDirectory(meta.parent_path());
             }
             catch (const util::ferror& ferr)
             {
@@ -436,7 +1056,7 @@ public:
         }
         catch (const std::exception& e)
         {
-            NLOG_ERR("dump() failed to synchronize metadata, file: {1}.meta, error: {2}") 
+            NLOG_ERR("dump() failed to synchronize metadata, file: {1}.meta, error: {2}")
                 % _filename.wstring()
                 % e.what();
             error = util::MakeError(util::kRuntimeError);
@@ -454,10 +1074,17 @@ public:
                 return true;
 
             {
-                std::lock_guard<std::mutex> locker(_mutexFile);
-                util::file_write(_file, bytes.data(), size);
+                auto locker = lock(_mutexFile);
+                _storage->write(_bytesProcessed, bytes.data(), size);
             }
-            _bytesProcessed += size;
+
+            // 顺序填充即是从头开始连续完成的区间
+            auto position = _bytesProcessed.fetch_add(size);
+            {
+                auto locker = lock(_mutex);
+                insert_finished({ position, position + size - 1 });
+            }
+            _bytesFinished += size;
         }
         catch (const util::ferror& ferr)
         {
@@ -470,7 +1097,35 @@ public:
         return !error;
     }
 
-    bool fill(Range2& range, 
+    //! 顺序模式: 丢弃已写入的数据, 从头开始写入 (服务器不支持 或 拒绝了续传)
+    bool rewind(std::error_code& error)
+    {
+        error.clear();
+        try
+        {
+            {
+                auto locker = lock(_mutexFile);
+                _storage->resize(std::max<int64_t>(_bytesTotal, 0));
+            }
+            {
+                auto locker = lock(_mutex);
+                _finishedRanges.clear();
+                publish_finished();
+            }
+            _bytesProcessed = 0;
+            _bytesFinished = 0;
+        }
+        catch (const util::ferror& ferr)
+        {
+            NLOG_ERR("rewind() failed, error: {1}") % ferr.message();
+            error = util::MakeErrorFromNative(ferr.code(), _filename, util::kFilesystemError);
+        }
+
+        return !error;
+    }
+
+    // 填充在途区间, 按位置写入文件, 不需要加锁
+    bool fill(Range2& range,
         const std::string_view& bytes, int64_t size,
         std::error_code& error)
     {
@@ -482,12 +1137,18 @@ public:
             if (size <= 0) // 没有可填充的数据
                 return true;
             util_assert(range.position >= range.start);
+            util_assert(range.slot >= 0 && range.slot < kSlotCapacity);
+            if (superseded(range)) // 输给了对端, 由调用者中止
+                return false;
+
+            clip(range);
+            if (range.state == Range2::kFilled) // 已到达拆分点
+                return true;
+            size = std::min<int64_t>(size, range.end + 1 - range.position);
 
             try
             {
-                std::lock_guard<std::mutex> locker(_mutexFile);
-                util::file_seek(_file, range.position, 0);
-                util::file_write(_file, bytes.data(), size);
+                _storage->write(range.position, bytes.data(), size);
             }
             catch (const util::ferror& ferr)
             {
@@ -498,7 +1159,7 @@ public:
                     % ferr.message();
                 return !(error = util::MakeErrorFromNative(ferr.code(), _filename, util::kFilesystemError));
             }
-            _bytesProcessed += size;
+            _bytesProcessed.fetch_add(size, std::memory_order_relaxed);
 
             // position 是下一个要填充的元素
             range.position = range.position + size;
@@ -507,12 +1168,10 @@ public:
             else
                 range.state = Range2::kPartial;
 
-            std::lock_guard<std::recursive_mutex> locker(_mutex);
-            auto it = _allocateRanges.find(range);
-            if (it != _allocateRanges.end()) {
-                const_cast<Range2&>(*it).state = range.state;
-                const_cast<Range2&>(*it).position = range.position;
-            }
+            _slots[range.slot].position.store(range.position, std::memory_order_release);
+            clip(range); // 写入期间被拆分
+            if (range.state == Range2::kFilled && _slots[range.slot].twin.load(std::memory_order_relaxed) >= 0)
+                supersede_twin(range);
         }
         catch (const std::exception& e)
         {
@@ -526,10 +1185,7 @@ public:
     }
 
     bool is_full() const {
-        std::lock_guard<std::recursive_mutex> locker(const_cast<std::recursive_mutex&>(_mutex));
-        if (_finishedRanges.size() == 1)
-            return *_finishedRanges.cbegin() == Range2{ 0, _bytesTotal - 1 };
-        return false;
+        return _bytesTotal > 0 && _bytesFinished.load(std::memory_order_acquire) == _bytesTotal;
     }
 
     int64_t size() const {
@@ -539,8 +1195,79 @@ public:
     }
 
     int64_t processed() const {
+        // 对冲的双方在决出胜负前均计入, 不超过总大小
+        if (_bytesTotal > 0)
+            return std::min<int64_t>(_bytesProcessed, _bytesTotal);
         return _bytesProcessed;
     }
+
+    //! 区间状态的快照, 不阻塞填充 分配 及归还, 可由界面线程周期性的调用
+    //! 先读取已完成区间的视图再读取槽位: 其间完成的区间 仍在途 或 已归还(视为待分配), 只会低估进度
+    //! @param progress 输出, 复用其中的缓冲, 重复调用时不再分配内存
+    void progress(RangeProgress& progress) const
+    {
+        progress.total = _bytesTotal;
+        progress.processed = processed();
+        progress.finished.clear();
+        progress.inflight.clear();
+        progress.available.clear();
+
+        if (_viewDirty.load(std::memory_order_acquire)) {
+            std::unique_lock<std::mutex> locker(_mutex, std::try_to_lock);
+            if (locker.owns_lock())
+                flush_finished();
+        }
+        {
+            auto& view = pin_view();
+            progress.epoch = view.epoch;
+            progress.finished.assign(view.ranges.begin(), view.ranges.end());
+            unpin_view(view);
+        }
+
+        auto& finished = progress.finished;
+        for (int i = 0; _slots && i < kSlotCapacity; ++i)
+        {
+            if (!_slots[i].busy.load(std::memory_order_acquire))
+                continue;
+            auto range = read_slot(i);
+            if (!range.valid())
+                continue;
+            // 已完成但尚未释放槽位的区间
+            auto it = std::upper_bound(finished.begin(), finished.end(), Range{ range.start, range.start });
+            if (it != finished.begin() && std::prev(it)->end >= range.end)
+                continue;
+            progress.inflight.push_back(range);
+        }
+        std::sort(progress.inflight.begin(), progress.inflight.end());
+
+        int64_t next = 0;
+        auto f = finished.begin();
+        auto a = progress.inflight.begin();
+        while (f != finished.end() || a != progress.inflight.end())
+        {
+            const Range* r = nullptr;
+            if (a == progress.inflight.end() || (f != finished.end() && f->start < a->start))
+                r = &*f++;
+            else
+                r = &*a++;
+
+            if (r->start > next)
+                progress.available.push_back({ next, r->start - 1 });
+            next = std::max(next, r->end + 1);
+        }
+        if (next < _bytesTotal)
+            progress.available.push_back({ next, _bytesTotal - 1 });
+    }
+
+    void trace() const {
+        snapshot().trace();
+    }
+
+#ifdef RANGE_FILE_STATISTICS
+    const RangeFileStatistics& statistics() const {
+        return _statistics;
+    }
+#endif
 };
 
 //
@@ -559,6 +1286,174 @@ inline std::ostream& operator<<(std::ostream& os, const Range2& br) {
 
 inline void UtilTestForClassRangeFile()
 {
+    if (1)
+    {
+        // 对冲: 先完成者胜出, 输家中止, 重复的部分不计数
+        auto path = std::filesystem::temp_directory_path() / "range_file_hedge.bin";
+        std::error_code ecode;
+        std::string buffer(1024, 'x');
+
+        RangeFile rf(4096, 1024);
+        rf.open(path, ecode);
+        util_assert(!ecode);
+
+        Range2 ranges[4];
+        for (auto& r : ranges)
+            util_assert(rf.allocate(r));
+        for (int i = 0; i < 3; ++i) {
+            rf.fill(ranges[i], buffer, ranges[i].size(), ecode);
+            rf.deallocate(ranges[i]);
+        }
+
+        Range2 origin = ranges[3], hedge;
+        rf.fill(origin, buffer, 100, ecode);
+        util_assert(!rf.allocate(hedge));
+        util_assert(rf.hedge(hedge, 1) && hedge.start == origin.position);
+        util_assert(!rf.hedge(ranges[0], 1)); // 每个区间只对冲一次
+
+        rf.fill(hedge, buffer, 200, ecode);
+        rf.fill(origin, buffer, 300, ecode);
+        rf.fill(hedge, buffer, hedge.end - hedge.position + 1, ecode);
+        util_assert(rf.superseded(origin));
+        util_assert(!rf.fill(origin, buffer, 1, ecode));
+        rf.deallocate(hedge);
+        rf.deallocate(origin);
+
+        util_assert(rf.is_full() && rf.processed() == 4096);
+        rf.close(true, ecode);
+        std::filesystem::remove(path, ecode);
+    }
+
+    if (1)
+    {
+        // 分段进度: 已完成, 在途(含填充位置), 待分配
+        auto path = std::filesystem::temp_directory_path() / "range_file_progress.bin";
+        std::error_code ecode;
+        std::string buffer(1024, 'x');
+
+        RangeFile rf(4096, 1024);
+        rf.open(path, ecode);
+        util_assert(!ecode);
+
+        Range2 ranges[4];
+        for (auto& r : ranges)
+            util_assert(rf.allocate(r));
+        rf.fill(ranges[0], buffer, ranges[0].size(), ecode);
+        rf.deallocate(ranges[0]);
+        rf.fill(ranges[1], buffer, 100, ecode);
+        rf.deallocate(ranges[2]); // 未填充, 归还
+
+        RangeProgress progress;
+        rf.progress(progress);
+        util_assert(progress.total == 4096 && progress.processed == 1124);
+        util_assert(progress.finished.size() == 1 && progress.finished[0] == (Range{ 0, 1023 }));
+        util_assert(progress.inflight.size() == 2 && progress.inflight[0].position == 1124);
+        util_assert(progress.available.size() == 1 && progress.available[0] == (Range{ 2048, 3071 }));
+
+        auto epoch = progress.epoch;
+        rf.progress(progress);
+        util_assert(progress.epoch == epoch); // 没有变化
+
+        rf.fill(ranges[1], buffer, ranges[1].end - ranges[1].position + 1, ecode);
+        rf.deallocate(ranges[1]);
+        rf.progress(progress);
+        util_assert(progress.epoch != epoch && progress.finished[0] == (Range{ 0, 2047 }));
+        util_assert(progress.inflight.size() == 1 && progress.inflight[0].start == 3072);
+
+        rf.deallocate(ranges[3]);
+        rf.close(false, ecode);
+        std::filesystem::remove(path, ecode);
+        std::filesystem::remove(std::filesystem::path(path) += ".meta", ecode);
+    }
+
+    if (1)
+    {
+        // 顺序模式的进度以多点模式续传: 已写入的部分保留, 其余的部分重新分配
+        auto path = std::filesystem::temp_directory_path() / "range_file_stream.bin";
+        std::error_code ecode;
+        std::string buffer(4096, 'x');
+        {
+            RangeFile rf(4096, 4096);
+            rf.set_stream(true);
+            rf.open(path, ecode);
+            util_assert(!ecode);
+            rf.fill(buffer, 1000, ecode);
+            util_assert(rf.dump(ecode));
+            rf.close(false, ecode);
+        }
+
+        RangeFile rf(4096, 1024);
+        rf.open(path, ecode);
+        util_assert(!ecode && rf.processed() == 1000);
+
+        Range2 range;
+        int count = 0;
+        while (rf.allocate(range)) {
+            util_assert(range.start >= 1000);
+            rf.fill(range, buffer, range.size(), ecode);
+            rf.deallocate(range);
+            ++count;
+        }
+        util_assert(count == 4 && rf.is_full() && rf.processed() == 4096);
+        util_assert(rf.close(true, ecode));
+        util_assert(!std::filesystem::exists(std::filesystem::path(path) += ".meta"));
+        std::filesystem::remove(path, ecode);
+    }
+
+    if (1)
+    {
+        // 开放区间: 新的连接拆分在途区间, 持有者到达拆分点即停止
+        auto path = std::filesystem::temp_directory_path() / "range_file_split.bin";
+        std::error_code ecode;
+        std::string buffer(4096, 'x');
+
+        RangeFile rf(4096, 1024);
+        rf.set_open_ended(true);
+        rf.open(path, ecode);
+        util_assert(!ecode);
+
+        Range2 owner, other;
+        util_assert(rf.allocate(owner) && owner.size() == 4096);
+        rf.fill(owner, buffer, 96, ecode);
+        util_assert(!rf.allocate(other));
+        util_assert(rf.split(other, 1024) && other.start == 96 + 2000 && other.end == 4095);
+        util_assert(!rf.split(other, 1024)); // 剩余不足以再拆分
+
+        rf.fill(owner, buffer, 3000, ecode); // 越过拆分点的部分不计入
+        util_assert(owner.state == Range2::kFilled && owner.end == other.start - 1);
+        util_assert(rf.processed() == other.start);
+        rf.fill(other, buffer, other.size(), ecode);
+        rf.deallocate(owner);
+        rf.deallocate(other);
+
+        util_assert(rf.is_full() && rf.processed() == 4096);
+        rf.close(true, ecode);
+        std::filesystem::remove(path, ecode);
+    }
+
+    if (1)
+    {
+        // 分段策略: 每个连接顺序的下载各自的区域, 区域耗尽后从剩余最多的区域中取
+        RangeFile rf(8 * 1024, 1024);
+        rf.set_policy(std::make_shared<StridedPolicy>(), 2);
+
+        Range2 a, b, c, d;
+        util_assert(rf.allocate(a, 0) && a.start == 0);
+        util_assert(rf.allocate(b, 1) && b.start == 4096);
+        util_assert(rf.allocate(c, 1) && c.start == 5120);
+        util_assert(rf.allocate(d, 0) && d.start == 1024);
+
+        std::list<Range2> ranges;
+        Range2 range;
+        while (rf.allocate(range, 1))
+            ranges.push_back(range);
+        util_assert(ranges.size() == 4 && ranges.back().start == 3072); // 通道 1 耗尽后取通道 0 的剩余
+        util_assert(!rf.allocate(range, 0));
+
+        rf.deallocate(b);
+        util_assert(rf.allocate(range, 1) && range.start == 4096); // 归还的区间优先分配给所在区域的连接
+    }
+
     if (0)
     {
         RangeFile rf(0x100000 * 10);
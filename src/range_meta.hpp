@@ -0,0 +1,476 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef range_meta_h__
+#define range_meta_h__
+
+#include <set>
+#include <list>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <memory_resource>
+
+#include "config.h"
+#include "range.hpp"
+#include "common/assert.hpp"
+#include "string/string_util.h"
+
+#include <boost/crc.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/serialization/set.hpp>
+#include <boost/serialization/serialization.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+//
+// 包含填充状态的文件区间
+//
+struct Range2 : public Range {
+    int64_t position = 0; // 不包含右边端点
+    enum {
+        kUnfilled,
+        kPending,
+        kPartial,
+        kFilled,
+    } state = kUnfilled;
+    int slot = -1; // 在途区间的槽位, 由 RangeFile::allocate() 指派
+};
+
+//! 运行期的区间集合, 节点由 RangeFile 的节点池分配
+using RangeSet = std::pmr::set<Range2>;
+
+//
+// 区间化文件的元数据, 用于状态的序列化
+//
+struct RangeFileMeta {
+    int64_t          _blockHint = 0;
+    int64_t          _bytesTotal = -1;
+    int64_t          _bytesProcessed = 0;
+    std::set<Range2> _allocateRanges;
+    std::set<Range2> _finishedRanges;
+    std::set<Range2> _availableRanges;
+    bool             _stream = false;   // 顺序模式, 仅记录从头开始连续写入的长度
+    std::string      _validator;        // 顺序模式下续传的校验符 (ETag 或 Last-Modified)
+
+    void trace() {
+        std::list<std::string> text;
+        for (auto const& r : _finishedRanges)
+            text.push_back(util::sformat("[%08" PRIx64 ", %08" PRIx64 "]", r.start, r.end));
+        NLOG_PRO(" - Status: finished-ranges: {1}, available-ranges: {2}, available-ranges: {3}")
+            % _finishedRanges.size()
+            % _availableRanges.size()
+            % _allocateRanges.size();
+        NLOG_PRO(" - Finished: ") << boost::join(text, ", ");
+        NLOG_PRO(" - BytesProcessed: ") << _bytesProcessed;
+    }
+
+    bool valid() {
+        auto size = 0LL;
+        for (auto const& r : _finishedRanges)
+            size += r.size();
+        for (auto const& r : _availableRanges)
+            size += r.size();
+        for (auto const& r : _allocateRanges)
+            size += r.size();
+        return size == _bytesTotal;
+    }
+};
+
+namespace boost {
+    namespace serialization {
+        template<class Archive>
+        void serialize(Archive& ar, Range2& d, const unsigned int version) {
+            ar & d.start;
+            ar & d.end;
+            ar & d.position;
+            ar & d.state;
+        }
+
+        template<class Archive>
+        void serialize(Archive& ar, RangeFileMeta& d, const unsigned int version) {
+            ar & d._blockHint;
+            ar & d._bytesTotal;
+            ar & d._bytesProcessed;
+            ar & d._allocateRanges;
+            ar & d._finishedRanges;
+            ar & d._availableRanges;
+        }
+    } // namespace serialization
+} // boost
+
+//
+// 元数据的文件格式 (小端字节序)
+//
+// +--------+------------------------------------------------------------+
+// | header | magic, version, flags, blockHint, bytesTotal, bytesFinished |
+// |        | blockCount, partialCount, checksum                         |
+// +--------+------------------------------------------------------------+
+// | bitmap | (blockCount + 7) / 8 字节, 按 blockHint 划分的块是否已完成  |
+// +--------+------------------------------------------------------------+
+// | partial| partialCount * { start, end }, 不足一个整块的已完成区间     |
+// +--------+------------------------------------------------------------+
+//
+// 检查点的大小与写入耗时只与块数量相关(O(blocks/8)), 不随碎片化增长;
+// 校验和覆盖头部(校验和字段置零)与所有数据, 恢复时通过一次内存映射读取.
+// 正在处理的区间中已填充的部分同样记录为已完成的区间.
+//
+// 顺序模式(flags 包含 kStream)没有位图及部分区间, 头部之后是 extra 字节的续传校验符,
+// bytesFinished 即是从头开始连续写入的长度, bytesTotal 可以为 -1(未知长度).
+//
+struct RangeMetaHeader {
+    static constexpr uint32_t kMagic   = 0x4D465252; // "RRFM"
+    static constexpr uint16_t kVersion = 1;
+    static constexpr size_t   kSize    = 48;
+    static constexpr uint16_t kStream  = 0x0001;
+
+    uint32_t magic         = kMagic;
+    uint16_t version       = kVersion;
+    uint16_t flags         = 0;
+    int64_t  blockHint     = 0;
+    int64_t  bytesTotal    = -1;
+    int64_t  bytesFinished = 0;
+    uint32_t blockCount    = 0;
+    uint32_t partialCount  = 0;
+    uint32_t checksum      = 0;
+    uint32_t extra         = 0;
+};
+
+namespace range_meta {
+
+    template<class T>
+    inline void put(std::vector<char>& buffer, size_t offset, T value) {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            buffer[offset + i] = static_cast<char>((static_cast<uint64_t>(value) >> (i * 8)) & 0xff);
+    }
+
+    template<class T>
+    inline T get(const char* data, size_t offset) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(data[offset + i])) << (i * 8);
+        return static_cast<T>(value);
+    }
+
+    inline void put_header(std::vector<char>& buffer, const RangeMetaHeader& h) {
+        put(buffer, 0,  h.magic);
+        put(buffer, 4,  h.version);
+        put(buffer, 6,  h.flags);
+        put(buffer, 8,  h.blockHint);
+        put(buffer, 16, h.bytesTotal);
+        put(buffer, 24, h.bytesFinished);
+        put(buffer, 32, h.blockCount);
+        put(buffer, 36, h.partialCount);
+        put(buffer, 40, h.checksum);
+        put(buffer, 44, h.extra);
+    }
+
+    inline RangeMetaHeader get_header(const char* data) {
+        RangeMetaHeader h;
+        h.magic         = get<uint32_t>(data, 0);
+        h.version       = get<uint16_t>(data, 4);
+        h.flags         = get<uint16_t>(data, 6);
+        h.blockHint     = get<int64_t>(data, 8);
+        h.bytesTotal    = get<int64_t>(data, 16);
+        h.bytesFinished = get<int64_t>(data, 24);
+        h.blockCount    = get<uint32_t>(data, 32);
+        h.partialCount  = get<uint32_t>(data, 36);
+        h.checksum      = get<uint32_t>(data, 40);
+        h.extra         = get<uint32_t>(data, 44);
+        return h;
+    }
+
+    inline uint32_t checksum(const char* data, size_t size) {
+        // 校验和字段(偏移 40)视为零
+        boost::crc_32_type crc;
+        const char zero[4] = {};
+        crc.process_bytes(data, 40);
+        crc.process_bytes(zero, 4);
+        crc.process_bytes(data + 44, size - 44);
+        return crc.checksum();
+    }
+
+} // namespace range_meta
+
+//! @brief 将顺序模式的元数据编码, 头部之后仅包含续传校验符
+inline std::vector<char> EncodeStreamMeta(const RangeFileMeta& meta)
+{
+    RangeMetaHeader header;
+    header.flags         = RangeMetaHeader::kStream;
+    header.bytesTotal    = meta._bytesTotal;
+    header.bytesFinished = meta._bytesProcessed;
+    header.extra         = static_cast<uint32_t>(meta._validator.size());
+
+    std::vector<char> buffer(RangeMetaHeader::kSize + meta._validator.size());
+    std::copy(meta._validator.begin(), meta._validator.end(), buffer.begin() + RangeMetaHeader::kSize);
+
+    range_meta::put_header(buffer, header);
+    header.checksum = range_meta::checksum(buffer.data(), buffer.size());
+    range_meta::put_header(buffer, header);
+    return buffer;
+}
+
+//! @brief 将元数据编码为块位图格式
+inline std::vector<char> EncodeRangeMeta(const RangeFileMeta& meta)
+{
+    if (meta._stream)
+        return EncodeStreamMeta(meta);
+
+    util_assert(meta._blockHint > 0 && meta._bytesTotal > 0);
+    const int64_t hint  = meta._blockHint;
+    const int64_t total = meta._bytesTotal;
+
+    // 已完成的区间 与 正在处理的区间中已填充的部分
+    std::vector<Range> done;
+    done.reserve(meta._finishedRanges.size() + meta._allocateRanges.size());
+    for (auto const& r : meta._finishedRanges)
+        done.push_back(r);
+    for (auto const& r : meta._allocateRanges) {
+        if (r.position > r.start)
+            done.push_back({ r.start, r.position - 1 });
+    }
+    std::sort(done.begin(), done.end());
+
+    RangeMetaHeader header;
+    header.blockHint  = hint;
+    header.bytesTotal = total;
+    header.blockCount = static_cast<uint32_t>((total + hint - 1) / hint);
+
+    std::vector<char> bitmap((header.blockCount + 7) / 8, 0);
+    std::vector<Range> partials;
+
+    Range last;
+    auto flush = [&](const Range& r) {
+        header.bytesFinished += r.size();
+
+        // 完全被覆盖的块: [first, last]
+        int64_t first = (r.start + hint - 1) / hint;
+        int64_t final = r.end == total - 1 ? header.blockCount - 1 : (r.end + 1) / hint - 1;
+        if (first > final) {
+            partials.push_back(r);
+            return;
+        }
+
+        for (int64_t i = first; i <= final; ++i)
+            bitmap[i / 8] |= static_cast<char>(1 << (i % 8));
+        if (r.start < first * hint)
+            partials.push_back({ r.start, first * hint - 1 });
+        if (std::min((final + 1) * hint, total) - 1 < r.end)
+            partials.push_back({ (final + 1) * hint, r.end });
+    };
+    for (auto const& r : done)
+    {
+        if (last.valid() && last.mergeable(r)) {
+            last = last + r;
+            continue;
+        }
+        if (last.valid())
+            flush(last);
+        last = r;
+    }
+    if (last.valid())
+        flush(last);
+
+    header.partialCount = static_cast<uint32_t>(partials.size());
+
+    std::vector<char> buffer(RangeMetaHeader::kSize + bitmap.size() + partials.size() * 16);
+    std::copy(bitmap.begin(), bitmap.end(), buffer.begin() + RangeMetaHeader::kSize);
+    for (size_t i = 0; i < partials.size(); ++i) {
+        auto offset = RangeMetaHeader::kSize + bitmap.size() + i * 16;
+        range_meta::put(buffer, offset, partials[i].start);
+        range_meta::put(buffer, offset + 8, partials[i].end);
+    }
+
+    range_meta::put_header(buffer, header);
+    header.checksum = range_meta::checksum(buffer.data(), buffer.size());
+    range_meta::put_header(buffer, header);
+    return buffer;
+}
+
+//! @brief 解码块位图格式的元数据, 未完成的部分均记录为待分配的区间
+//! @return 格式无效 或 校验失败返回 false
+inline bool DecodeRangeMeta(const char* data, size_t size, RangeFileMeta& meta)
+{
+    if (size < RangeMetaHeader::kSize)
+        return false;
+
+    auto header = range_meta::get_header(data);
+    if (header.magic != RangeMetaHeader::kMagic || header.version != RangeMetaHeader::kVersion)
+        return false;
+
+    if (header.flags & RangeMetaHeader::kStream)
+    {
+        if (size != RangeMetaHeader::kSize + size_t(header.extra) ||
+            range_meta::checksum(data, size) != header.checksum)
+            return false;
+        if (header.bytesFinished < 0 || (header.bytesTotal > 0 && header.bytesFinished > header.bytesTotal))
+            return false;
+
+        meta = {};
+        meta._stream         = true;
+        meta._bytesTotal     = header.bytesTotal;
+        meta._bytesProcessed = header.bytesFinished;
+        meta._validator.assign(data + RangeMetaHeader::kSize, header.extra);
+        if (header.bytesFinished > 0)
+            meta._finishedRanges.insert({ 0, header.bytesFinished - 1, header.bytesFinished, Range2::kFilled });
+        return true;
+    }
+
+    if (header.blockHint <= 0 || header.bytesTotal <= 0 ||
+        header.blockCount != static_cast<uint32_t>((header.bytesTotal + header.blockHint - 1) / header.blockHint))
+        return false;
+
+    size_t bitmapSize = (header.blockCount + 7) / 8;
+    if (size != RangeMetaHeader::kSize + bitmapSize + size_t(header.partialCount) * 16)
+        return false;
+    if (range_meta::checksum(data, size) != header.checksum)
+        return false;
+
+    const int64_t hint = header.blockHint;
+    const int64_t total = header.bytesTotal;
+    const char* bitmap = data + RangeMetaHeader::kSize;
+
+    std::vector<Range> done;
+    for (int64_t i = 0; i < header.blockCount; ++i)
+    {
+        if ((bitmap[i / 8] & (1 << (i % 8))) == 0)
+            continue;
+        Range block = { i * hint, std::min((i + 1) * hint, total) - 1 };
+        if (!done.empty() && done.back().mergeable(block))
+            done.back() = done.back() + block;
+        else
+            done.push_back(block);
+    }
+    for (uint32_t i = 0; i < header.partialCount; ++i)
+    {
+        auto offset = RangeMetaHeader::kSize + bitmapSize + i * 16;
+        Range r = { range_meta::get<int64_t>(data, offset), range_meta::get<int64_t>(data, offset + 8) };
+        if (!r.valid() || r.end >= total)
+            return false;
+        done.push_back(r);
+    }
+    std::sort(done.begin(), done.end());
+
+    meta = {};
+    meta._blockHint  = hint;
+    meta._bytesTotal = total;
+
+    int64_t next = 0;
+    Range2 last;
+    for (auto const& r : done)
+    {
+        if (last.valid() && last.mergeable(r)) {
+            last.end = std::max(last.end, r.end);
+            continue;
+        }
+        if (last.valid())
+            meta._finishedRanges.insert(last);
+        last = { r.start, r.end, r.end + 1, Range2::kFilled };
+    }
+    if (last.valid())
+        meta._finishedRanges.insert(last);
+
+    for (auto const& r : meta._finishedRanges)
+    {
+        if (r.start > next)
+            meta._availableRanges.insert({ next, r.start - 1 });
+        next = r.end + 1;
+        meta._bytesProcessed += r.size();
+    }
+    if (next < total)
+        meta._availableRanges.insert({ next, total - 1 });
+
+    return meta._bytesProcessed == header.bytesFinished;
+}
+
+//! @brief 读取元数据文件, 通过内存映射一次性读取块位图格式, 兼容旧版本的 boost 序列化格式
+//! @return 文件无效返回 false
+inline bool LoadRangeMeta(const std::filesystem::path& filename, RangeFileMeta& meta)
+{
+    namespace bip = boost::interprocess;
+    std::error_code ecode;
+    if (std::filesystem::file_size(filename, ecode) == 0 || ecode) // 空文件无法映射
+        return false;
+    {
+        // 按原生的字符类型打开(Windows 下为 wchar_t), 非 ASCII 的路径不经过 ANSI 代码页转换
+        bip::file_mapping mapping(filename.c_str(), bip::read_only);
+        bip::mapped_region region(mapping, bip::read_only);
+
+        auto data = static_cast<const char*>(region.get_address());
+        auto size = region.get_size();
+        if (size >= 4 && range_meta::get<uint32_t>(data, 0) == RangeMetaHeader::kMagic)
+            return DecodeRangeMeta(data, size, meta);
+    }
+
+    // 旧版本的格式, 恢复时丢弃正在处理的区间
+    std::ifstream is(filename, std::ios::binary);
+    boost::archive::binary_iarchive ia(is);
+    ia >> meta;
+    for (auto const& r : meta._allocateRanges) {
+        meta._availableRanges.insert({ r.start, r.end });
+        meta._bytesProcessed -= (r.position - r.start);
+    }
+    meta._allocateRanges.clear();
+    return meta.valid();
+}
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForRangeMeta()
+{
+    RangeFileMeta meta;
+    meta._blockHint  = 100;
+    meta._bytesTotal = 1050;                                        // 11 个块, 最后一块 50 字节
+    meta._finishedRanges.insert({ 0, 249, 250, Range2::kFilled });  // 块 0,1 + 部分 [200, 249]
+    meta._finishedRanges.insert({ 900, 1049, 1050, Range2::kFilled }); // 块 9, 10
+    meta._allocateRanges.insert({ 300, 399, 350, Range2::kPartial });  // 部分 [300, 349]
+    meta._availableRanges.insert({ 250, 299 });
+    meta._availableRanges.insert({ 400, 899 });
+
+    auto bytes = EncodeRangeMeta(meta);
+    util_assert(bytes.size() == RangeMetaHeader::kSize + 2 + 2 * 16);
+
+    RangeFileMeta decoded;
+    util_assert(DecodeRangeMeta(bytes.data(), bytes.size(), decoded));
+    util_assert(decoded.valid());
+    util_assert(decoded._bytesProcessed == 250 + 150 + 50);
+    util_assert(decoded._finishedRanges.size() == 3);
+    util_assert(decoded._availableRanges.size() == 2);
+    util_assert((*decoded._finishedRanges.begin() == Range2{ 0, 249 }));
+    util_assert((*decoded._availableRanges.rbegin() == Range2{ 350, 899 }));
+
+    bytes[RangeMetaHeader::kSize] ^= 0x04; // 破坏位图
+    util_assert(!DecodeRangeMeta(bytes.data(), bytes.size(), decoded));
+
+    // 顺序模式, 未知长度
+    RangeFileMeta stream;
+    stream._stream = true;
+    stream._bytesProcessed = 12345;
+    stream._validator = "\"5e3c-abc\"";
+    bytes = EncodeRangeMeta(stream);
+    util_assert(bytes.size() == RangeMetaHeader::kSize + stream._validator.size());
+    util_assert(DecodeRangeMeta(bytes.data(), bytes.size(), decoded));
+    util_assert(decoded._stream && decoded._bytesTotal == -1 && decoded._bytesProcessed == 12345);
+    util_assert(decoded._validator == stream._validator);
+    util_assert(decoded._finishedRanges.size() == 1 && decoded._finishedRanges.begin()->end == 12344);
+
+    // 非 ASCII 的路径 及 空文件
+    auto path = std::filesystem::temp_directory_path() / std::filesystem::u8path(u8"range_meta_\u4e0b\u8f7d.meta");
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+    util_assert(LoadRangeMeta(path, decoded) && decoded._bytesProcessed == 12345);
+    std::ofstream(path, std::ios::binary | std::ios::trunc).close();
+    util_assert(!LoadRangeMeta(path, decoded));
+    std::error_code ecode;
+    std::filesystem::remove(path, ecode);
+}
+#endif
+
+#endif // range_meta_h__
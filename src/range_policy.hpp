@@ -0,0 +1,191 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef range_policy_h__
+#define range_policy_h__
+
+#include <set>
+#include <memory>
+#include <random>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+
+#include "range.hpp"
+#include "range_meta.hpp"
+#include "downloader.h"
+#include "common/assert.hpp"
+
+//
+// 区间的分配策略
+//
+// 策略只在构建待分配队列时排列队列并划分通道(每个连接一个通道), 分配本身依然是各个通道上无锁的游标;
+// 通道耗尽后连接从剩余最多的通道中取区间. 归还的区间由策略在持有 RangeFile 的锁时选择.
+//
+class RangePolicy
+{
+public:
+    virtual ~RangePolicy() = default;
+
+    //! 排列待分配队列(按位置升序), 划分通道
+    //! @param queue 待分配的区间
+    //! @param lanes 通道数, 即连接数
+    //! @return 各个通道在队列中的起始索引, 末尾追加队列的长度
+    virtual std::vector<size_t> arrange(std::vector<Range>& queue, int lanes) {
+        return { 0, queue.size() };
+    }
+
+    //! 从归还的区间中选择下一个分配的区间
+    //! @param available 归还的区间, 不为空
+    //! @param lane 连接的通道
+    virtual RangeSet::const_iterator pick(const RangeSet& available, int lane) {
+        return available.begin();
+    }
+};
+
+//
+// 顺序: 从文件头部开始, 即默认的策略
+//
+class SequentialPolicy : public RangePolicy
+{
+};
+
+//
+// 分段: 文件按连接数划分为大小相近的连续区域, 每个连接顺序的下载各自的区域,
+// 服务端对每个连接的读取保持顺序, 适合机械硬盘上的源站
+//
+class StridedPolicy : public RangePolicy
+{
+    std::vector<int64_t> _starts; // 各个通道区域的起始位置
+
+public:
+    std::vector<size_t> arrange(std::vector<Range>& queue, int lanes) override
+    {
+        lanes = std::max(lanes, 1);
+        int64_t total = 0;
+        for (auto const& r : queue)
+            total += r.size();
+
+        std::vector<size_t> bounds = { 0 };
+        _starts.assign(1, queue.empty() ? 0 : queue.front().start);
+        int64_t sum = 0;
+        for (size_t i = 0; i < queue.size() && (int)bounds.size() < lanes; ++i)
+        {
+            sum += queue[i].size();
+            if (sum * lanes >= total * (int64_t)bounds.size() && i + 1 < queue.size()) {
+                bounds.push_back(i + 1);
+                _starts.push_back(queue[i + 1].start);
+            }
+        }
+        bounds.push_back(queue.size());
+        return bounds;
+    }
+
+    RangeSet::const_iterator pick(const RangeSet& available, int lane) override
+    {
+        // 优先选择连接所在区域之内的区间, 保持读取的顺序
+        if (lane < 0 || lane >= (int)_starts.size())
+            return available.begin();
+        auto it = available.lower_bound(Range2{ _starts[lane], _starts[lane] });
+        return it == available.end() ? available.begin() : it;
+    }
+};
+
+//
+// 尾部优先: 从文件尾部开始, 适用于索引位于末尾的格式(如 zip, mp4 的 moov 在末尾时)
+//
+class TailFirstPolicy : public RangePolicy
+{
+public:
+    std::vector<size_t> arrange(std::vector<Range>& queue, int lanes) override
+    {
+        std::reverse(queue.begin(), queue.end());
+        return { 0, queue.size() };
+    }
+
+    RangeSet::const_iterator pick(const RangeSet& available, int lane) override {
+        return std::prev(available.end());
+    }
+};
+
+//
+// 随机: 打散服务端的读取, 用于测试 或 避免多个客户端同时读取相同的位置
+//
+class RandomPolicy : public RangePolicy
+{
+    std::mt19937_64 _engine{ std::random_device{}() };
+
+public:
+    std::vector<size_t> arrange(std::vector<Range>& queue, int lanes) override
+    {
+        std::shuffle(queue.begin(), queue.end(), _engine);
+        return { 0, queue.size() };
+    }
+
+    RangeSet::const_iterator pick(const RangeSet& available, int lane) override
+    {
+        std::uniform_int_distribution<size_t> distribution(0, available.size() - 1);
+        return std::next(available.begin(), distribution(_engine));
+    }
+};
+
+//! @brief 创建内置的分配策略
+inline std::shared_ptr<RangePolicy> MakeRangePolicy(range_allocation allocation)
+{
+    switch (allocation)
+    {
+    case kAllocateStrided:
+        return std::make_shared<StridedPolicy>();
+    case kAllocateTailFirst:
+        return std::make_shared<TailFirstPolicy>();
+    case kAllocateRandom:
+        return std::make_shared<RandomPolicy>();
+    default:
+        return std::make_shared<SequentialPolicy>();
+    }
+}
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForRangePolicy()
+{
+    auto blocks = [] {
+        std::vector<Range> queue;
+        for (int64_t i = 0; i < 10; ++i)
+            queue.push_back({ i * 100, i * 100 + 99 });
+        return queue;
+    };
+
+    auto queue = blocks();
+    StridedPolicy strided;
+    auto bounds = strided.arrange(queue, 3);
+    util_assert((bounds == std::vector<size_t>{ 0, 4, 7, 10 }));
+
+    RangeSet available = { { 100, 199 }, { 450, 499 }, { 800, 899 } };
+    util_assert(strided.pick(available, 1)->start == 450);
+    util_assert(strided.pick(available, 2)->start == 800);
+
+    queue = blocks();
+    bounds = strided.arrange(queue, 20); // 通道多于区间
+    util_assert(bounds.size() == queue.size() + 1 && bounds.back() == queue.size());
+
+    queue = blocks();
+    TailFirstPolicy tail;
+    tail.arrange(queue, 3);
+    util_assert(queue.front().start == 900 && queue.back().start == 0);
+    util_assert(tail.pick(available, 0)->start == 800);
+
+    queue = blocks();
+    RandomPolicy random;
+    bounds = random.arrange(queue, 3);
+    std::sort(queue.begin(), queue.end());
+    util_assert((queue == blocks()) && bounds.size() == 2);
+}
+#endif
+
+#endif // range_policy_h__
@@ -0,0 +1,254 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef range_storage_h__
+#define range_storage_h__
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#include "config.h"
+#include "uerror.h"
+#include "metrics.hpp"
+#include "common/scope.hpp"
+#include "common/assert.hpp"
+#include "filesystem/path_util.h"
+
+#ifndef _WIN32
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+//
+// 调整文件大小, 超出部分被截断, 不足部分以零填充
+//
+inline void RangeFileResize(util::ffile& file, int64_t size)
+{
+#ifdef _WIN32
+    util::file_seek(file, size, 0);
+
+    // If the function succeeds, the return value is nonzero.
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-setendoffile
+    //
+    if (SetEndOfFile((HANDLE)file.native_id()) == 0)
+        throw util::ferror(::GetLastError(), "SetEndOfFile() failed");
+#else
+    if (::ftruncate(file.native_id(), size) != 0)
+        throw util::ferror(errno, "ftruncate() failed");
+#endif
+    util::file_seek(file, 0, 0);
+}
+
+//
+// 按位置写入文件, 不改变也不依赖文件指针, 因此可以多线程并发的写入不同的区间
+//
+inline void RangeFileWriteAt(util::ffile& file, int64_t offset, const char* data, int64_t size)
+{
+    MetricTimer timer(Metrics::Instance().writeLatency);
+    while (size > 0)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        overlapped.Offset     = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD written = 0;
+        DWORD bytes = static_cast<DWORD>(std::min<int64_t>(size, 0x40000000));
+        if (WriteFile((HANDLE)file.native_id(), data, bytes, &written, &overlapped) == 0)
+            throw util::ferror(::GetLastError(), "WriteFile() failed");
+#else
+        auto written = ::pwrite(file.native_id(), data, static_cast<size_t>(size), offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw util::ferror(errno, "pwrite() failed");
+        }
+#endif
+        offset += written;
+        data   += written;
+        size   -= written;
+    }
+}
+
+//
+// 将文件已写入的数据同步到磁盘, 仅同步数据及读取数据所必需的元信息(如文件长度)
+//
+inline void RangeFileSync(util::ffile& file)
+{
+#ifdef _WIN32
+    if (FlushFileBuffers((HANDLE)file.native_id()) == 0)
+        throw util::ferror(::GetLastError(), "FlushFileBuffers() failed");
+#elif defined(__APPLE__)
+    if (::fsync(file.native_id()) != 0)
+        throw util::ferror(errno, "fsync() failed");
+#else
+    if (::fdatasync(file.native_id()) != 0)
+        throw util::ferror(errno, "fdatasync() failed");
+#endif
+}
+
+//
+// 同步目录项, 保证重命名在断电后依然有效. Windows 下没有对应的操作, 忽略
+//
+inline void RangeFileSyncDirectory(const std::filesystem::path& dir)
+{
+#ifndef _WIN32
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        throw util::ferror(errno, "open() directory failed");
+    util_scope_exit = [&] { ::close(fd); };
+    if (::fsync(fd) != 0 && errno != EINVAL) // 部分文件系统不支持同步目录
+        throw util::ferror(errno, "fsync() directory failed");
+#else
+    (void)dir;
+#endif
+}
+
+//
+// 区间文件的存储后端
+//
+// RangeFile 只通过存储后端读写数据, 下载引擎无需感知数据写往何处:
+//  - FileStorage:   磁盘文件, 默认的后端, 支持元数据及续传
+//  - MemoryStorage: 内存, 用于测试 及 DownloadToBuffer()
+//  - NullStorage:   丢弃数据但依然跟踪区间, 用于在磁盘较慢或空间不足的机器上测试网络吞吐量
+// 失败时抛出 util::ferror
+//
+class RangeStorage
+{
+public:
+    virtual ~RangeStorage() = default;
+
+    //! 是否持久化, 只有持久的存储才使用临时文件, 元数据 及 续传
+    virtual bool persistent() const {
+        return false;
+    }
+
+    //! @return 已有内容的长度
+    virtual int64_t open(const std::filesystem::path& filename) = 0;
+    virtual bool valid() const = 0;
+
+    //! 调整大小, 超出部分被截断, 不足部分以零填充
+    virtual void resize(int64_t size) = 0;
+
+    //! 按位置写入, 不同的区间可以并发的写入
+    virtual void write(int64_t offset, const char* data, int64_t size) = 0;
+
+    //! 将已写入的数据同步到持久的介质
+    virtual void sync() {}
+
+    virtual void close() = 0;
+};
+
+class FileStorage : public RangeStorage
+{
+    util::ffile _file;
+
+public:
+    bool persistent() const override {
+        return true;
+    }
+
+    int64_t open(const std::filesystem::path& filename) override
+    {
+        auto file = util::file_open(filename, O_CREAT | O_RDWR);
+        auto size = util::file_size(file);
+        _file = file;
+        return size;
+    }
+
+    bool valid() const override {
+        return static_cast<bool>(_file);
+    }
+
+    void resize(int64_t size) override {
+        RangeFileResize(_file, size);
+    }
+
+    void write(int64_t offset, const char* data, int64_t size) override {
+        RangeFileWriteAt(_file, offset, data, size);
+    }
+
+    void sync() override {
+        RangeFileSync(_file);
+    }
+
+    void close() override {
+        _file.close();
+    }
+};
+
+//
+// 内存存储, 关闭后数据依然保留, 直到被取走
+// 已知长度时打开后即分配全部的空间, 并发写入的区间互不重叠;
+// 只有顺序模式(未知长度, 仅一个写入者)才在写入时增长
+//
+class MemoryStorage : public RangeStorage
+{
+    std::vector<char> _data;
+    bool              _opened = false;
+
+public:
+    int64_t open(const std::filesystem::path&) override
+    {
+        _data.clear();
+        _opened = true;
+        return 0;
+    }
+
+    bool valid() const override {
+        return _opened;
+    }
+
+    void resize(int64_t size) override {
+        _data.assign(static_cast<size_t>(size), 0);
+    }
+
+    void write(int64_t offset, const char* data, int64_t size) override
+    {
+        if (offset + size > static_cast<int64_t>(_data.size()))
+            _data.resize(static_cast<size_t>(offset + size));
+        std::memcpy(_data.data() + offset, data, static_cast<size_t>(size));
+    }
+
+    void close() override {
+        _opened = false;
+    }
+
+    const std::vector<char>& data() const {
+        return _data;
+    }
+
+    std::vector<char> take() {
+        return std::move(_data);
+    }
+};
+
+class NullStorage : public RangeStorage
+{
+    bool _opened = false;
+
+public:
+    int64_t open(const std::filesystem::path&) override
+    {
+        _opened = true;
+        return 0;
+    }
+
+    bool valid() const override {
+        return _opened;
+    }
+
+    void resize(int64_t) override {}
+    void write(int64_t, const char*, int64_t) override {}
+
+    void close() override {
+        _opened = false;
+    }
+};
+
+#endif // range_storage_h__
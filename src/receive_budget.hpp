@@ -0,0 +1,99 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef receive_budget_h__
+#define receive_budget_h__
+
+#include <mutex>
+#include <algorithm>
+#include <curl/curl.h>
+
+#include "common/assert.hpp"
+
+//
+// 进程内共享的接收缓冲区预算
+//
+// 响应体由 libcurl 的接收缓冲区经写回调直接写入文件, 该缓冲区即是已接收而未写入的全部内存.
+// 每个会话创建时从预算中租用缓冲区, 预算不足时退回 libcurl 的默认大小(即使预算已耗尽也会分配),
+// 因此内存总量不超过 预算 + 连接数 x 默认大小, 与分块大小及并发的下载数无关.
+//
+class ReceiveBudget
+{
+    std::mutex _mutex;
+    int64_t    _budget    = 64 * 1024 * 1024;
+    int        _preferred = 64 * 1024;
+    int64_t    _used      = 0;
+
+public:
+    static constexpr int kMinimum = CURL_MAX_WRITE_SIZE; // libcurl 的默认大小
+    static constexpr int kMaximum = 512 * 1024;          // 旧版本 libcurl 允许的上限
+
+    static ReceiveBudget& Instance()
+    {
+        static ReceiveBudget budget;
+        return budget;
+    }
+
+    //! @param budget 所有会话的接收缓冲区总量(字节)
+    //! @param preferred 单个会话的接收缓冲区大小(字节)
+    void configure(int64_t budget, int preferred)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _budget    = std::max<int64_t>(budget, 0);
+        _preferred = std::clamp(preferred, kMinimum, kMaximum);
+    }
+
+    //! 租用缓冲区, 返回缓冲区的大小, 不小于 kMinimum
+    int acquire()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        int64_t remain = std::max<int64_t>(_budget - _used, 0);
+        int size = (int)std::min<int64_t>(_preferred, remain / kMinimum * kMinimum);
+        size = std::max(size, kMinimum);
+        _used += size;
+        return size;
+    }
+
+    void release(int size)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _used -= size;
+        util_assert(_used >= 0);
+    }
+
+    int64_t used()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return _used;
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForReceiveBudget()
+{
+    ReceiveBudget budget;
+    budget.configure(ReceiveBudget::kMinimum * 5, ReceiveBudget::kMinimum * 2);
+
+    int a = budget.acquire();
+    int b = budget.acquire();
+    int c = budget.acquire(); // 预算不足, 只剩一个默认大小
+    int d = budget.acquire(); // 预算耗尽, 退回默认大小
+    util_assert(a == ReceiveBudget::kMinimum * 2 && b == a);
+    util_assert(c == ReceiveBudget::kMinimum && d == ReceiveBudget::kMinimum);
+    util_assert(budget.used() == ReceiveBudget::kMinimum * 6); // 超出预算的部分为每个会话一个默认大小
+
+    budget.release(a);
+    budget.release(b);
+    budget.release(c);
+    budget.release(d);
+    util_assert(budget.used() == 0);
+}
+#endif
+
+#endif // receive_budget_h__
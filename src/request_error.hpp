@@ -0,0 +1,197 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef request_error_h__
+#define request_error_h__
+
+#include <atomic>
+#include <system_error>
+#include <curl/curl.h>
+
+#include "nlog.h"
+#include "uerror.h"
+#include "downloader.h"
+#include "metrics.hpp"
+#include "http_header.hpp"
+#include "cpr/cpr.h"
+#include "common/assert.hpp"
+
+enum { kRunning = 0, kFailed, kCancelled };
+
+//
+// 错误处理
+// 致命错误 & 非致命错误
+//   文件系统错误
+//      磁盘已满
+//      权限不足
+//      磁盘无法访问
+//   网络错误
+//      断开连接 ?
+// 返回true, 表示致命错误
+// 
+inline bool HandleRequestError(
+    long status_code,
+    const cpr::Error& request_error,
+    const std::error_code& fserr, 
+    const std::atomic_int& flag,
+    std::error_code& error)
+{
+    auto& metrics = Metrics::Instance();
+    if (fserr)
+    {
+        // 因为文件操作错误终止, 归属为致命错误
+        metrics.error(kMetricErrorFilesystem);
+        NLOG_ERR("Filesystem Error: {1}, status_code: {2}")
+            % fserr.message()
+            % status_code;
+        error = fserr;
+        return true;
+    }
+
+    switch (request_error.code)
+    {
+    case cpr::ErrorCode::REQUEST_CANCELLED:
+        util_assert(flag != kRunning);
+        metrics.error(kMetricErrorCancelled);
+        if (flag == kCancelled) // 只有取消才改写error
+            error = util::MakeError(util::kOperationInterrupted);
+        return true;
+
+        // 余下的错误, 不好判断是否属于致命错误(因为网络错误可能因为重试变得好转)
+        // 因此, 这里仅设置错误码, 由外部做决断
+    case cpr::ErrorCode::NETWORK_SEND_FAILURE:
+    case cpr::ErrorCode::NETWORK_RECEIVE_ERROR:
+    case cpr::ErrorCode::HOST_RESOLUTION_FAILURE:
+    case cpr::ErrorCode::CONNECTION_FAILURE:
+    case cpr::ErrorCode::OPERATION_TIMEDOUT:
+    case cpr::ErrorCode::SSL_CONNECT_ERROR:
+        // 网络错误
+        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
+            % status_code
+            % int(request_error.code)
+            % request_error.message;
+        metrics.error(kMetricErrorNetwork);
+        error = util::MakeError(util::kNetworkError);
+        return false;
+
+    case cpr::ErrorCode::INTERNAL_ERROR:
+    case cpr::ErrorCode::EMPTY_RESPONSE:
+        // 未知错误 或 运行时错误
+        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
+            % status_code
+            % int(request_error.code)
+            % request_error.message;
+        metrics.error(kMetricErrorNetwork);
+        error = util::MakeError(util::kNetworkError);
+        return false;
+
+    case cpr::ErrorCode::OK:
+        if (200 == status_code || 206 == status_code)
+            return false; // 成功
+
+        if (400 <= status_code)
+            metrics.error(kMetricErrorHttp);
+
+        if (404 == status_code) { // 资源不存在
+            error = util::MakeError(util::kFileNotFound);
+            return true;
+        }
+
+        if (503 == status_code) { // 服务不可用
+            error = util::MakeError(util::kServerError);
+            return true;
+        }
+
+        if (400 <= status_code) { // 下载错误
+            NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
+                % status_code
+                % int(request_error.code)
+                % request_error.message;
+            error = util::MakeError(util::kOperationFailed);
+        }
+        return false;
+
+    default:
+        NLOG_ERR("Request Error: status_code: {1}, error_code: {2}, error_message: {3}")
+            % status_code
+            % int(request_error.code)
+            % request_error.message;
+        metrics.error(kMetricErrorRuntime);
+        error = util::MakeError(util::kRuntimeError);
+    }
+
+    return false;
+}
+
+inline bool HandleRequestError(
+    const cpr::Response& response,
+    const std::error_code& fserr,
+    const std::atomic_int& flag,
+    std::error_code& error)
+{
+    return HandleRequestError(response.status_code, response.error, fserr, flag, error);
+}
+
+// 将 libcurl 的错误码转换为 cpr 的错误, 下载终止导致的中止归为取消
+inline cpr::Error MakeRequestError(CURLcode code, const std::atomic_int& flag)
+{
+    cpr::Error error(code, curl_easy_strerror(code));
+    if ((code == CURLE_WRITE_ERROR || code == CURLE_ABORTED_BY_CALLBACK) && flag != kRunning)
+        error.code = cpr::ErrorCode::REQUEST_CANCELLED;
+    return error;
+}
+
+//! @brief 处理探测请求(GetFileAttribute)的结果, 填充文件长度及范围支持
+//! @return 成功返回 true
+inline bool HandleProbeResult(CURL* curl, CURLcode res, file_attribute& attribute, std::error_code& error)
+{
+    error.clear();
+    Metrics::Instance().requests.add();
+    switch (res)
+    {
+    case CURLE_OK: {
+        long status_code{};
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status_code);
+        if (200 == status_code || 206 == status_code)
+            curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &attribute.contentLength);
+        if (206 == status_code)
+        {
+            // 206 表示服务器响应了范围请求: "bytes 0-N/total", 总长度以此为准,
+            // 即使服务器使用分块编码而缺少 Content-Length
+            int64_t start, end, total;
+            if (ParseContentRange(attribute.contentRange, start, end, total) && total > 0)
+                attribute.contentLength = total;
+            if (!SupportRanges(attribute))
+                attribute.acceptRanges = "bytes";
+        }
+    }
+    break;
+
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+        // 网络错误
+        NLOG_ERR("GetFileAttribute() failed, error: {1}, {2}")
+            % res
+            % curl_easy_strerror(res);
+        error = util::MakeError(util::kNetworkError);
+        break;
+
+    default:
+        // 未知错误 或 运行时错误
+        NLOG_ERR("GetFileAttribute() failed, error: {1}, {2}")
+            % res
+            % curl_easy_strerror(res);
+        error = util::MakeError(util::kRuntimeError);
+        break;
+    }
+
+    return !error;
+}
+
+#endif // request_error_h__
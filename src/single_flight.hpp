@@ -0,0 +1,260 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef single_flight_h__
+#define single_flight_h__
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <system_error>
+#include <condition_variable>
+
+#include "uerror.h"
+#include "common/assert.hpp"
+
+//
+// 进程内相同下载的合并 (single-flight)
+//
+// 相同 url 及请求头的并发下载只执行一次传输, 由首个调用者(发起者)执行, 其余的调用者(跟随者)
+// 等待其完成并获得进度及结果; 跟随者的目标文件不同时, 由发起者在完成后复制.
+// 每个目标文件同时只属于一次传输, 目标文件相同而 url 不同的下载依次执行, 不会同时打开同一个 RangeFile.
+//
+class SingleFlight
+{
+public:
+    enum Role {
+        kLeader,    // 执行传输
+        kFollower,  // 等待发起者的传输完成
+        kConflict,  // 目标文件正被另一次传输使用, 等待其完成后重新加入
+    };
+
+    struct Flight
+    {
+        std::string                 key;
+        std::filesystem::path       filename;       // 发起者的目标文件
+        std::atomic<int64_t>        total     = 0;  // 发起者最近汇报的进度
+        std::atomic<int64_t>        processed = 0;
+
+        std::mutex                  mutex;
+        std::condition_variable     cv;
+        bool                        done = false;
+        std::error_code             error;
+        bool                        copying = false; // 发起者正在复制, 离开的跟随者的目标文件由 finish() 释放
+        std::map<std::filesystem::path, std::error_code> copies; // 跟随者的目标文件 及 复制的结果
+
+        //! 等待传输完成, 超时返回 false
+        bool wait_for(int milliseconds)
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            return cv.wait_for(locker, std::chrono::milliseconds(milliseconds), [this] { return done; });
+        }
+
+        //! 传输完成后, 目标文件为 filename 的调用者的结果
+        std::error_code result(const std::filesystem::path& filename)
+        {
+            std::lock_guard<std::mutex> locker(mutex);
+            util_assert(done);
+            auto it = copies.find(Normalize(filename));
+            return error || it == copies.end() ? error : it->second;
+        }
+    };
+
+private:
+    std::mutex                                               _mutex;
+    std::map<std::string, std::shared_ptr<Flight>>           _flights; // 按 url 及请求头
+    std::map<std::filesystem::path, std::shared_ptr<Flight>> _files;   // 按目标文件
+
+public:
+    static SingleFlight& Instance()
+    {
+        static SingleFlight flight;
+        return flight;
+    }
+
+    //! 合并的依据: url 及请求头 (请求头可能影响响应的内容, 例如身份验证)
+    static std::string Key(const std::string& url, const std::map<std::string, std::string>& header)
+    {
+        std::string key = url;
+        for (auto const& item : header)
+            key.append("\n").append(item.first).append(": ").append(item.second);
+        return key;
+    }
+
+    static std::filesystem::path Normalize(const std::filesystem::path& filename)
+    {
+        std::error_code ecode;
+        auto path = std::filesystem::absolute(filename, ecode);
+        return (ecode ? filename : path).lexically_normal();
+    }
+
+    //! 加入下载
+    //! @param flight 输出发起者的传输, 冲突时为占用目标文件的传输
+    Role join(const std::string& key, const std::filesystem::path& filename, std::shared_ptr<Flight>& flight)
+    {
+        auto file = Normalize(filename);
+        std::lock_guard<std::mutex> locker(_mutex);
+
+        auto owner = _files.find(file);
+        auto it = _flights.find(key);
+        if (it != _flights.end())
+        {
+            flight = it->second;
+            if (file == flight->filename)
+                return kFollower;
+            if (owner != _files.end()) {
+                flight = owner->second;
+                return kConflict;
+            }
+
+            std::lock_guard<std::mutex> guard(flight->mutex);
+            flight->copies[file] = {};
+            _files[file] = flight;
+            return kFollower;
+        }
+
+        if (owner != _files.end()) {
+            flight = owner->second;
+            return kConflict;
+        }
+
+        flight = std::make_shared<Flight>();
+        flight->key = key;
+        flight->filename = file;
+        _flights[key] = flight;
+        _files[file] = flight;
+        return kLeader;
+    }
+
+    //! 跟随者放弃等待, 发起者不再复制其目标文件
+    void leave(const std::shared_ptr<Flight>& flight, const std::filesystem::path& filename)
+    {
+        auto file = Normalize(filename);
+        {
+            std::lock_guard<std::mutex> guard(flight->mutex);
+            flight->copies.erase(file);
+            if (flight->copying) // 可能正在复制到该文件, 不能提前交给其他的下载
+                return;
+        }
+
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto owner = _files.find(file);
+        if (owner != _files.end() && owner->second == flight && file != flight->filename)
+            _files.erase(owner);
+    }
+
+    //! 发起者完成: 不再接受新的跟随者, 成功时将文件复制到跟随者的目标文件, 然后唤醒所有跟随者,
+    //! 目标文件在此之后才释放
+    void finish(const std::shared_ptr<Flight>& flight, const std::error_code& error)
+    {
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            _flights.erase(flight->key);
+        }
+
+        // 复制大文件可能耗时很久, 在锁外进行, 跟随者在此期间依然可以汇报进度 或 放弃等待
+        std::vector<std::filesystem::path> files = { flight->filename };
+        {
+            std::lock_guard<std::mutex> guard(flight->mutex);
+            for (auto const& item : flight->copies)
+                files.push_back(item.first);
+            flight->copying = true;
+        }
+
+        std::map<std::filesystem::path, std::error_code> results;
+        for (size_t i = 1; i < files.size() && !error; ++i)
+        {
+            {
+                std::lock_guard<std::mutex> guard(flight->mutex);
+                if (!flight->copies.count(files[i])) // 已放弃等待
+                    continue;
+            }
+
+            std::error_code ecode;
+            std::filesystem::copy_file(flight->filename, files[i], std::filesystem::copy_options::overwrite_existing, ecode);
+            if (ecode)
+                results[files[i]] = util::MakeErrorFromNative(ecode.value(), files[i], util::kFilesystemError);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(flight->mutex);
+            for (auto& [file, ecode] : flight->copies)
+            {
+                auto it = results.find(file);
+                if (it != results.end())
+                    ecode = it->second;
+            }
+            flight->error = error;
+            flight->done = true;
+        }
+        flight->cv.notify_all();
+
+        std::lock_guard<std::mutex> locker(_mutex);
+        for (auto const& file : files)
+        {
+            auto owner = _files.find(file);
+            if (owner != _files.end() && owner->second == flight)
+                _files.erase(owner);
+        }
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+#include <fstream>
+
+inline void UtilTestForSingleFlight()
+{
+    auto dir = std::filesystem::temp_directory_path();
+    auto a = dir / "single_flight_a.bin";
+    auto b = dir / "single_flight_b.bin";
+    auto c = dir / "single_flight_c.bin";
+
+    SingleFlight sf;
+    std::shared_ptr<SingleFlight::Flight> leader, follower, copier, other, late;
+    auto key = SingleFlight::Key("http://127.0.0.1/a.bin", {});
+    util_assert(sf.join(key, a, leader) == SingleFlight::kLeader);
+    util_assert(sf.join(key, a, follower) == SingleFlight::kFollower && follower == leader);
+    util_assert(sf.join(key, b, copier) == SingleFlight::kFollower && copier == leader);
+    util_assert(sf.join(key, c, late) == SingleFlight::kFollower);
+    sf.leave(late, c); // 放弃等待, 不再复制
+    util_assert(sf.join(SingleFlight::Key("http://127.0.0.1/b.bin", {}), b, other) == SingleFlight::kConflict);
+    util_assert(other == leader && !leader->wait_for(0));
+
+    std::ofstream(a, std::ios::binary) << "single-flight";
+    std::error_code ecode;
+    std::filesystem::remove(c, ecode);
+    sf.finish(leader, {});
+    util_assert(follower->wait_for(0) && !follower->result(a) && !copier->result(b));
+    util_assert(std::filesystem::file_size(b) == 13 && !std::filesystem::exists(c));
+
+    // 复制失败时跟随者的结果为 BaseError
+    auto key2 = SingleFlight::Key("http://127.0.0.1/c.bin", {});
+    auto missing = dir / "single_flight_missing" / "c.bin";
+    util_assert(sf.join(key2, a, leader) == SingleFlight::kLeader);
+    util_assert(sf.join(key2, missing, copier) == SingleFlight::kFollower);
+    sf.finish(leader, {});
+    ecode = copier->result(missing);
+    util_assert(ecode && ecode.category() == util::ErrorCategory::Instance());
+
+    // 完成后目标文件被释放, 相同的 url 重新开始一次传输
+    util_assert(sf.join(key, b, other) == SingleFlight::kLeader);
+    sf.finish(other, std::make_error_code(std::errc::io_error));
+    util_assert(other->result(b));
+
+    std::filesystem::remove(a, ecode);
+    std::filesystem::remove(b, ecode);
+}
+#endif
+
+#endif // single_flight_h__
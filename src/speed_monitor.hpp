@@ -0,0 +1,221 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef speed_monitor_h__
+#define speed_monitor_h__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "common/assert.hpp"
+
+//
+// 连接测速
+//
+// 每个连接按固定的窗口统计速度并发布到 SpeedMonitor, 窗口结束时若明显慢于所有连接的中位数,
+// 则认为该连接经由了一条糟糕的路径, 由调用者中止并换一个新的连接.
+//
+class SpeedMonitor
+{
+    std::unique_ptr<std::atomic<int64_t>[]> _speeds; // 每个连接最近一个窗口的速度(字节/秒), -1 表示没有数据
+    int    _count  = 0;
+    double _ratio  = 0;
+    int    _window = 0;
+
+public:
+    //! @param count 连接数
+    //! @param ratio 慢于中位数的该比例时视为慢速连接, 0 表示不检测
+    //! @param window 统计窗口(毫秒)
+    SpeedMonitor(int count, double ratio, int window)
+        : _speeds(new std::atomic<int64_t>[std::max(count, 1)])
+        , _count(std::max(count, 1))
+        , _ratio(ratio)
+        , _window(std::max(window, 100))
+    {
+        for (int i = 0; i < _count; ++i)
+            _speeds[i] = -1;
+    }
+
+    bool enabled() const {
+        return _ratio > 0 && _count >= 3; // 连接太少时中位数没有意义
+    }
+
+    int window() const {
+        return _window;
+    }
+
+    double ratio() const {
+        return _ratio;
+    }
+
+    void update(int index, int64_t speed) {
+        util_assert(index >= 0 && index < _count);
+        _speeds[index].store(speed, std::memory_order_relaxed);
+    }
+
+    void clear(int index) {
+        update(index, -1);
+    }
+
+    //! 有数据的连接的速度中位数, 不足三个连接时返回 -1
+    int64_t median() const
+    {
+        int64_t values[64];
+        std::vector<int64_t> buffer;
+        int64_t* speeds = values;
+        if (_count > 64) {
+            buffer.resize(_count);
+            speeds = buffer.data();
+        }
+
+        int n = 0;
+        for (int i = 0; i < _count; ++i) {
+            auto speed = _speeds[i].load(std::memory_order_relaxed);
+            if (speed >= 0)
+                speeds[n++] = speed;
+        }
+        if (n < 3)
+            return -1;
+
+        std::nth_element(speeds, speeds + n / 2, speeds + n);
+        return speeds[n / 2];
+    }
+};
+
+//
+// 单个连接的测速, 在进度回调中驱动
+//
+// 窗口跨越连接上的多个请求, 因此分块较小, 单个请求很快完成时也可以得到速度.
+// 窗口只累计请求进行中的时长, 连接在线程池中排队 或 两个请求之间的空闲不计入;
+// 连续 kSlowWindows 个窗口均明显慢于中位数才视为慢速, 偶然的波动不会换掉健康的连接.
+//
+class SpeedMeter
+{
+    using clock = std::chrono::steady_clock;
+
+    SpeedMonitor*     _monitor = nullptr;
+    int               _index   = 0;
+    clock::time_point _start   = {};  // 本段计时的开始, 暂停时为空
+    clock::duration   _elapsed = {};  // 窗口内已累计的时长, 不含本段
+    int64_t           _bytes   = 0;   // 窗口内接收的字节数
+    int64_t           _last    = 0;   // 本次请求已接收的字节数
+    int               _strikes = 0;   // 连续慢于中位数的窗口数
+    bool              _slow    = false;
+
+public:
+    static constexpr int kSlowWindows = 2;
+
+    SpeedMeter() = default;
+    SpeedMeter(SpeedMonitor& monitor, int index)
+        : _monitor(&monitor), _index(index) {
+    }
+
+    //! 开始一个新的请求
+    void begin()
+    {
+        _last = 0;
+        _slow = false;
+        resume();
+    }
+
+    //! 请求在进行中, 开始计时
+    void resume()
+    {
+        if (_start == clock::time_point{})
+            _start = clock::now();
+    }
+
+    //! 请求结束 或 连接让出线程, 停止计时
+    void pause()
+    {
+        if (_start != clock::time_point{}) {
+            _elapsed += clock::now() - _start;
+            _start = {};
+        }
+    }
+
+    //! 新的连接, 重新开始测速
+    void reset()
+    {
+        _start = {};
+        _elapsed = {};
+        _bytes = 0;
+        _strikes = 0;
+        _monitor->clear(_index);
+    }
+
+    //! @param now 本次请求已接收的字节数
+    //! @return 返回 false 表示在最近的若干个窗口内持续明显慢于其他连接, 应当中止
+    bool update(int64_t now)
+    {
+        _bytes += std::max<int64_t>(now - _last, 0);
+        _last = now;
+
+        auto t = clock::now();
+        auto total = _elapsed + (_start == clock::time_point{} ? clock::duration{} : t - _start);
+        auto elapse = std::chrono::duration_cast<std::chrono::milliseconds>(total).count();
+        if (elapse < _monitor->window())
+            return true;
+
+        auto speed = _bytes * 1000 / std::max<int64_t>(elapse, 1);
+        _monitor->update(_index, speed);
+        if (_start != clock::time_point{})
+            _start = t;
+        _elapsed = {};
+        _bytes = 0;
+
+        if (!_monitor->enabled())
+            return true;
+
+        auto median = _monitor->median();
+        if (median > 0 && speed < median * _monitor->ratio())
+            _strikes++;
+        else
+            _strikes = 0;
+        if (_strikes >= kSlowWindows) {
+            _slow = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool slow() const {
+        return _slow;
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+#include <thread>
+
+inline void UtilTestForSpeedMeter()
+{
+    SpeedMonitor monitor(3, 0.5, 100);
+    monitor.update(1, 1000000);
+    monitor.update(2, 1000000);
+
+    // 暂停期间(例如在线程池中排队)的时长不计入窗口
+    SpeedMeter meter(monitor, 0);
+    meter.begin();
+    meter.pause();
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    util_assert(meter.update(0));
+    meter.resume();
+
+    // 单个慢速的窗口不中止, 连续的才中止
+    std::this_thread::sleep_for(std::chrono::milliseconds(110));
+    util_assert(meter.update(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(110));
+    util_assert(!meter.update(20) && meter.slow());
+}
+#endif
+
+#endif // speed_monitor_h__
@@ -0,0 +1,300 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+#ifndef thread_pool_h__
+#define thread_pool_h__
+
+#include <list>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+#include "config.h"
+#include "nlog.h"
+#include "common/scope.hpp"
+#include "common/assert.hpp"
+
+#if !defined(_WIN32) && defined(__linux__)
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+class TaskGroup;
+
+//
+// 进程内共享的工作线程池
+//
+// 线程按需创建, 数量不超过上限, 空闲的线程常驻等待, 稳定后线程数量与并发的下载数无关.
+// 任务以 TaskGroup 为单位提交, 同一组内尚未开始执行的任务可以整体取消.
+//
+class ThreadPool
+{
+    struct Entry {
+        TaskGroup*            group;
+        std::function<void()> task;
+    };
+
+    std::mutex               _mutex;
+    std::condition_variable  _cv;
+    std::deque<Entry>        _queue;
+    std::list<std::thread>   _threads;
+    std::list<std::thread>   _exited;          // 因上限调低而退出的线程, 待回收
+    int                      _limit   = 16;
+    bool                     _pinned  = false;
+    int                      _count   = 0;     // 存活的线程数
+    int                      _idle    = 0;     // 空闲等待的线程数
+    bool                     _stopped = false;
+
+    static void Pin(std::thread& thread, int index)
+    {
+        unsigned cpus = std::max(std::thread::hardware_concurrency(), 1u);
+#ifdef _WIN32
+        SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (index % std::min(cpus, 64u)));
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread; (void)index; (void)cpus; // 不支持, 忽略
+#endif
+    }
+
+    void run(std::list<std::thread>::iterator self)
+    {
+        std::unique_lock<std::mutex> locker(_mutex);
+        while (true)
+        {
+            ++_idle;
+            _cv.wait(locker, [&] { return _stopped || !_queue.empty() || _count > _limit; });
+            --_idle;
+
+            // 上限被调低, 多余的线程在空闲时退出, 交由之后的 post() 回收
+            if (_stopped)
+                return;
+            if (_queue.empty() && _count > _limit) {
+                _exited.splice(_exited.end(), _threads, self);
+                --_count;
+                return;
+            }
+
+            Entry entry = std::move(_queue.front());
+            _queue.pop_front();
+
+            locker.unlock();
+            try {
+                entry.task();
+            }
+            catch (const std::exception& e) {
+                NLOG_ERR("ThreadPool unhandled exception: ") << e.what();
+            }
+            catch (...) {
+                NLOG_ERR("ThreadPool unhandled exception");
+            }
+            entry = {};
+            locker.lock();
+        }
+    }
+
+public:
+    ThreadPool() = default;
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            _stopped = true;
+        }
+        _cv.notify_all();
+        for (auto& t : _threads)
+            t.join();
+        for (auto& t : _exited)
+            t.join();
+    }
+
+    static ThreadPool& Instance()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    //! 设置线程数上限及是否绑定 CPU, 绑定仅对之后创建的线程生效
+    void configure(int threads, bool pinned)
+    {
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            _limit  = std::max(threads, 1);
+            _pinned = pinned;
+        }
+        _cv.notify_all();
+    }
+
+    int limit()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return _limit;
+    }
+
+    //! 是否有排队等待线程的任务
+    bool backlog()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return !_queue.empty();
+    }
+
+    //! 持有的线程数, 含已退出而尚未回收的线程
+    int threads()
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return int(_threads.size() + _exited.size());
+    }
+
+    void post(TaskGroup* group, std::function<void()> task)
+    {
+        std::list<std::thread> exited;
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            util_assert(!_stopped);
+            _queue.push_back({ group, std::move(task) });
+            exited.swap(_exited);
+
+            // 没有空闲线程可以立即执行, 且未达上限时才创建新的线程
+            if (_idle < (int)_queue.size() && _count < _limit)
+            {
+                auto self = _threads.emplace(_threads.end());
+                *self = std::thread([this, self] { run(self); });
+                if (_pinned)
+                    Pin(*self, _count);
+                ++_count;
+            }
+            _cv.notify_one();
+        }
+
+        // 退出的线程已不再持有锁, 很快结束
+        for (auto& t : exited)
+            t.join();
+    }
+
+    //! 移除该组尚未开始执行的任务, 返回移除的数量
+    int cancel(TaskGroup* group)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto it = std::remove_if(_queue.begin(), _queue.end(),
+            [&](const Entry& e) { return e.group == group; });
+        int count = (int)std::distance(it, _queue.end());
+        _queue.erase(it, _queue.end());
+        return count;
+    }
+};
+
+//
+// 一组相关的任务, 例如一次下载的所有连接
+//
+// 析构时取消尚未执行的任务, 并等待正在执行的任务结束, 因此任务可以安全的引用组所在作用域的变量.
+//
+class TaskGroup
+{
+    ThreadPool&             _pool;
+    std::mutex              _mutex;
+    std::condition_variable _cv;
+    int                     _pending = 0;
+
+    void done(int count)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _pending -= count;
+        if (_pending == 0)
+            _cv.notify_all();
+    }
+
+public:
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::Instance()) : _pool(pool) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup()
+    {
+        cancel();
+        wait();
+    }
+
+    //! 提交任务, 任务内可以继续向本组提交后续的任务
+    void run(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            ++_pending;
+        }
+        _pool.post(this, [this, task = std::move(task)]() mutable {
+            util_scope_exit = [&] { task = nullptr; done(1); }; // 先释放任务持有的资源
+            task();
+        });
+    }
+
+    void cancel()
+    {
+        if (int count = _pool.cancel(this))
+            done(count);
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> locker(_mutex);
+        _cv.wait(locker, [&] { return _pending == 0; });
+    }
+};
+
+//
+// 简易的单元测试
+//
+#if DEBUG || _DEBUG
+inline void UtilTestForThreadPool()
+{
+    ThreadPool pool;
+    pool.configure(2, false);
+
+    std::atomic<int> count = 0;
+    {
+        TaskGroup group(pool);
+        for (int i = 0; i < 8; ++i)
+            group.run([&] { count++; });
+        group.wait();
+        util_assert(count == 8);
+
+        // 任务可以提交后续的任务
+        std::function<void(int)> chain = [&](int n) {
+            count++;
+            if (n > 0)
+                group.run([&, n] { chain(n - 1); });
+        };
+        group.run([&] { chain(3); });
+        group.wait();
+        util_assert(count == 12);
+
+        // 反复调整上限, 退出的线程被回收, 持有的线程数不会增长
+        for (int i = 0; i < 4; ++i)
+        {
+            pool.configure(4, false);
+            for (int j = 0; j < 8; ++j)
+                group.run([&] { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+            group.wait();
+            pool.configure(1, false);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            group.run([] {});
+            group.wait();
+            util_assert(pool.threads() <= 4);
+        }
+    }
+}
+#endif
+
+#endif // thread_pool_h__
@@ -11,9 +11,13 @@
 #include <filesystem/path_util.h>
 #include <platform/platform_util.h>
 
+#ifdef _WIN32
 // SDK v7.1A 中没有定义这个错误码
-#ifndef ERROR_NO_SUCH_DEVICE
-#   define ERROR_NO_SUCH_DEVICE 433L
+#   ifndef ERROR_NO_SUCH_DEVICE
+#       define ERROR_NO_SUCH_DEVICE 433L
+#   endif
+#else
+#   include <cerrno>
 #endif
 
 namespace util {
@@ -23,6 +27,7 @@ std::error_code MakeErrorFromNative(
     const std::filesystem::path& filename,
     const Error defaultCode)
 {
+#ifdef _WIN32
     switch (ecode)
     {
     case ERROR_DISK_FULL:       // 磁盘空间不足或不支持大文件
@@ -77,6 +82,41 @@ std::error_code MakeErrorFromNative(
         }
         return MakeError(kFilesystemError);
     }
+#else
+    switch (ecode)
+    {
+    case ENOSPC:                // 磁盘空间不足
+    case EDQUOT:
+        return MakeError(kFilesystemNoSpace);
+
+    case EFBIG:                 // 超出文件系统支持的文件大小
+        return MakeError(kFilesystemNotSupportLargeFiles);
+
+    case EACCES:
+    case EPERM:
+    case EROFS:
+        return MakeError(kFileNotWritable);
+
+    case ENOENT:
+    case ENOTDIR:
+        return MakeError(kFileNotFound);
+
+    case ENODEV:                // 设备不存在, U 盘突然被拔出
+    case ENXIO:
+        return MakeError(kFilesystemUnavailable);
+
+    case ENAMETOOLONG:
+        return MakeError(kFilePathTooLong);
+
+    case EBUSY:
+    case ETXTBSY:
+        return MakeError(kFileWasUsedByOtherProcesses);
+
+    default:
+        if (ecode != 0)
+            return MakeError(kFilesystemError);
+    }
+#endif
 
     return MakeError(defaultCode);
 }
@@ -0,0 +1,318 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+//
+// RangeFile 的基准测试
+//
+// 由 N 个生产者线程以合成数据驱动 allocate/fill/deallocate, 主线程周期性的 dump,
+// 用于在没有网络的情况下评估下载引擎的改动.
+//
+// 数据块经由接收端写入, 以模拟传输层的写回调:
+//  - raw:    原始的 char* 数据块直接交给 RangeSink (当前的接收路径)
+//  - string: 每个数据块先构造为 std::string 再填充 (cpr::WriteCallback 的接收路径)
+//
+
+#include <nlog.h>
+#include "range_file.hpp"
+#include "body_sink.hpp"
+
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace chr = std::chrono;
+
+//
+// 统计每个线程的堆内存分配次数
+//
+static thread_local int64_t tAllocations = 0;
+
+void* operator new(std::size_t size)
+{
+    ++tAllocations;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+//
+// 合成数据: 任意偏移处的字节均可推算, 写入时无需计算, 结束后可以校验文件内容
+//
+struct SyntheticData
+{
+    static constexpr int kPeriod = 4093; // 素数, 避免与分块大小对齐
+    std::vector<char> pattern;
+
+    explicit SyntheticData(int64_t chunk) : pattern(kPeriod + chunk) {
+        for (size_t i = 0; i < pattern.size(); ++i)
+            pattern[i] = byte(i);
+    }
+
+    static char byte(int64_t offset) {
+        return static_cast<char>((offset % kPeriod) * 131 + 7);
+    }
+
+    const char* at(int64_t offset) const {
+        return pattern.data() + (offset % kPeriod);
+    }
+};
+
+//
+// 单个操作的计数与耗时
+//
+struct OpCounter
+{
+    int64_t count = 0;
+    int64_t nanos = 0;
+
+    template<class Fn>
+    auto measure(Fn&& fn) {
+        auto start = chr::steady_clock::now();
+        util_scope_exit = [&] {
+            count++;
+            nanos += chr::duration_cast<chr::nanoseconds>(chr::steady_clock::now() - start).count();
+        };
+        return fn();
+    }
+
+    OpCounter& operator+=(const OpCounter& other) {
+        count += other.count;
+        nanos += other.nanos;
+        return *this;
+    }
+};
+
+struct ProducerStats
+{
+    OpCounter allocate;
+    OpCounter fill;
+    OpCounter deallocate;
+    int64_t   bytes = 0;
+    int64_t   partials = 0;
+    int64_t   allocations = 0;
+};
+
+static int64_t ParseArg(int argc, char** argv, int index, int64_t value)
+{
+    if (argc > index)
+    {
+        char* tail = nullptr;
+        value = strtoll(argv[index], &tail, 10);
+        if ((tail && tail[0] != '\0') || value < 0)
+            return -1;
+    }
+    return value;
+}
+
+static void Report(const char* name, const OpCounter& op, double seconds)
+{
+    std::cout << util::sformat(" - %-10s count: %10" PRId64 ", ops/s: %12.0f, avg: %8.0f ns",
+        name, op.count, op.count / seconds, op.count ? double(op.nanos) / op.count : 0.0) << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    auto showHelp = []()
+        {
+            std::cerr << "Using rangefile_bench [threads] [size-MiB] [block-KiB] [chunk-KiB] [partial-%] [dump-ms] [dir] [raw|string] [file|memory|null]" << std::endl;
+            return -2;
+        };
+
+    auto threads   = ParseArg(argc, argv, 1, 8);
+    auto sizeMiB   = ParseArg(argc, argv, 2, 1024);
+    auto blockKiB  = ParseArg(argc, argv, 3, 1024);
+    auto chunkKiB  = ParseArg(argc, argv, 4, 16);
+    auto partial   = ParseArg(argc, argv, 5, 10);
+    auto dumpMs    = ParseArg(argc, argv, 6, 100);
+    auto directory = argc > 7 ? std::filesystem::path(argv[7]) : std::filesystem::temp_directory_path();
+    auto receive   = argc > 8 ? std::string(argv[8]) : std::string("raw");
+    auto backend   = argc > 9 ? std::string(argv[9]) : std::string("file");
+    // partial-% 为 0 即没有部分填充的基准, 其余的参数须为正数
+    if (threads <= 0 || sizeMiB <= 0 || blockKiB <= 0 || chunkKiB <= 0 || partial < 0 || dumpMs <= 0)
+        return showHelp();
+    if (receive != "raw" && receive != "string")
+        return showHelp();
+    if (backend != "file" && backend != "memory" && backend != "null")
+        return showHelp();
+
+    const int64_t size  = sizeMiB * 1024 * 1024;
+    const int64_t block = blockKiB * 1024;
+    const int64_t chunk = chunkKiB * 1024;
+    const auto filename = directory / "rangefile_bench.bin";
+
+    std::cout << "RangeFile benchmark ..." << std::endl;
+    std::cout << " - Threads: " << threads << std::endl;
+    std::cout << " - Size: " << sizeMiB << " MiB" << std::endl;
+    std::cout << " - BlockSize: " << blockKiB << " KiB" << std::endl;
+    std::cout << " - ChunkSize: " << chunkKiB << " KiB" << std::endl;
+    std::cout << " - Partial: " << partial << " %" << std::endl;
+    std::cout << " - Receive: " << receive << std::endl;
+    std::cout << " - Storage: " << backend << std::endl;
+    std::cout << " - File: " << filename.string() << std::endl;
+
+    std::error_code ecode;
+    SyntheticData data(chunk);
+    RangeFile rf(size, (int)block);
+    std::shared_ptr<MemoryStorage> memory;
+    if (backend == "memory")
+        rf.set_storage(memory = std::make_shared<MemoryStorage>());
+    else if (backend == "null")
+        rf.set_storage(std::make_shared<NullStorage>());
+    if (!rf.open(filename, ecode)) {
+        std::cerr << "RangeFile::open() failed, error: " << ecode.message() << std::endl;
+        return -1;
+    }
+
+    const bool rawReceive = receive == "raw";
+    const std::atomic_int running(0);
+
+    auto producer = [&](ProducerStats& stats, unsigned seed)
+    {
+        auto allocations = tAllocations;
+        util_scope_exit = [&] { stats.allocations = tAllocations - allocations; };
+
+        std::mt19937 gen(seed);
+        std::uniform_int_distribution<int> percent(0, 99);
+
+        Range2 range;
+        while (stats.allocate.measure([&] { return rf.allocate(range); }))
+        {
+            // 模拟连接中途断开: 只填充区间的一部分, 剩余部分归还后由其他生产者重新分配
+            int64_t limit = range.end + 1;
+            if (percent(gen) < partial) {
+                limit = std::uniform_int_distribution<int64_t>(range.start, range.end)(gen);
+                stats.partials++;
+            }
+
+            std::error_code ecode;
+            RangeSink sink(rf, range, running, ecode);
+            while (range.position < limit)
+            {
+                auto size = std::min(chunk, limit - range.position);
+                auto bytes = data.at(range.position);
+
+                auto filled = stats.fill.measure([&] {
+                    if (rawReceive)
+                        return sink.write(bytes, (size_t)size) || sink.completed();
+                    std::string text(bytes, (size_t)size);
+                    return rf.fill(range, text, size, ecode);
+                    });
+                if (!filled) {
+                    std::cerr << "RangeFile::fill() failed, error: " << ecode.message() << std::endl;
+                    break;
+                }
+                stats.bytes += size;
+            }
+
+            stats.deallocate.measure([&] { return rf.deallocate(range); });
+        }
+    };
+
+    auto start = chr::steady_clock::now();
+    auto seconds = [&] {
+        return chr::duration<double>(chr::steady_clock::now() - start).count();
+    };
+
+    std::vector<ProducerStats> stats(threads);
+    std::vector<std::shared_ptr<std::thread>> workers;
+    for (int i = 0; i < threads; ++i)
+        workers.push_back(std::make_shared<std::thread>(producer, std::ref(stats[i]), 5489u + i));
+
+    OpCounter dump;
+    while (!rf.is_full())
+    {
+        std::this_thread::sleep_for(chr::milliseconds(dumpMs));
+        if (!dump.measure([&] { return rf.dump(ecode); }))
+            std::cerr << "RangeFile::dump() failed, error: " << ecode.message() << std::endl;
+    }
+
+    for (auto t : workers)
+        t->join();
+    auto elapse = seconds();
+
+    ProducerStats total;
+    for (auto& s : stats)
+    {
+        total.allocate += s.allocate;
+        total.fill += s.fill;
+        total.deallocate += s.deallocate;
+        total.bytes += s.bytes;
+        total.partials += s.partials;
+        total.allocations += s.allocations;
+    }
+
+    std::cout << "Finished, elapse: " << util::sformat("%.3f s", elapse) << std::endl;
+    Report("allocate", total.allocate, elapse);
+    Report("fill", total.fill, elapse);
+    Report("deallocate", total.deallocate, elapse);
+    Report("dump", dump, elapse);
+    std::cout << " - Partials: " << total.partials << std::endl;
+    std::cout << " - Throughput: " << util::sformat("%.1f MiB/s", total.bytes / elapse / 1024 / 1024) << std::endl;
+    std::cout << " - Allocations: " << total.allocations << util::sformat(", per GiB: %.1f",
+        total.allocations / (total.bytes / 1024.0 / 1024 / 1024)) << std::endl;
+
+    auto& lock = rf.statistics();
+    std::cout << " - Lock acquires: " << lock.lockAcquires << ", contended: " << lock.lockContended
+              << ", wait: " << util::sformat("%.3f ms", lock.lockWaitNanos / 1e6) << std::endl;
+
+    bool full = rf.is_full();
+    if (!rf.close(full, ecode) || !full) {
+        std::cerr << "RangeFile::close() failed, full: " << full << ", error: " << ecode.message() << std::endl;
+        return -1;
+    }
+
+    // 校验文件内容, 丢弃数据时无从校验
+    if (backend == "null")
+        return 0;
+    if (memory)
+    {
+        auto& bytes = memory->data();
+        for (int64_t i = 0; i < size; ++i)
+        {
+            if ((int64_t)bytes.size() != size || bytes[i] != SyntheticData::byte(i)) {
+                std::cerr << "Verify failed, offset: " << i << std::endl;
+                return -1;
+            }
+        }
+        std::cout << "Verify succeed" << std::endl;
+        return 0;
+    }
+
+    auto file = util::file_open(filename, O_RDONLY);
+    std::vector<char> buffer(1024 * 1024);
+    for (int64_t offset = 0; offset < size; offset += buffer.size())
+    {
+        auto bytes = std::min<int64_t>(buffer.size(), size - offset);
+        util::file_read(file, buffer.data(), bytes);
+        for (int64_t i = 0; i < bytes; ++i)
+        {
+            if (buffer[i] != SyntheticData::byte(offset + i)) {
+                std::cerr << "Verify failed, offset: " << (offset + i) << std::endl;
+                return -1;
+            }
+        }
+    }
+    file.close();
+    util::file_remove(filename);
+
+    std::cout << "Verify succeed" << std::endl;
+    return 0;
+}
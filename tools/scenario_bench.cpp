@@ -0,0 +1,636 @@
+// This file is part of the downloader library
+//
+// Copyright (c) 2018-2023, zero.kwok@foxmail.com
+// For the full copyright and license information, please view the LICENSE
+// file that was distributed with this source code.
+
+//
+// 基于场景的性能回归测试
+//
+// 父进程在本机回环地址上运行一个合成数据的 HTTP 服务端(支持范围请求, 可注入延迟及连接重置),
+// 每个场景在独立的子进程中下载, 因此 CPU 时间及内存峰值只包含下载的开销, 且场景之间互不影响.
+// 结果输出为 JSON, 比较模式对比两次(通常是两个版本的 downloader 库)的结果并标记退化.
+//
+//  - tiny:       10000 个 4KiB 的小文件, 16 个并发
+//  - huge:       单个 20GiB 的文件
+//  - lossy:      512MiB, 服务端随机的重置连接
+//  - rtt:        256MiB, 服务端的每个请求延迟 100ms 后响应
+//  - concurrent: 200 个 8MiB 的文件同时下载
+//
+
+#include <nlog.h>
+#include "downloader.h"
+#include "common/assert.hpp"
+#include "string/string_util.h"
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#ifdef _WIN32
+#   include <windows.h>
+#   include <psapi.h>
+#else
+#   include <sys/time.h>
+#   include <sys/resource.h>
+#endif
+
+namespace chr = std::chrono;
+namespace asio = boost::asio;
+
+constexpr int64_t KiB = 1024;
+constexpr int64_t MiB = 1024 * KiB;
+constexpr int64_t GiB = 1024 * MiB;
+
+//
+// 合成数据: 任意偏移处的字节均可推算, 服务端无需读取文件, 下载完成后可以校验文件内容
+//
+struct SyntheticData
+{
+    static constexpr int kPeriod = 4093; // 素数, 避免与分块大小对齐
+    static constexpr int kChunk  = 64 * 1024;
+    std::vector<char> pattern;
+
+    SyntheticData() : pattern(kPeriod + kChunk) {
+        for (size_t i = 0; i < pattern.size(); ++i)
+            pattern[i] = byte(i);
+    }
+
+    static char byte(int64_t offset) {
+        return static_cast<char>((offset % kPeriod) * 131 + 7);
+    }
+
+    const char* at(int64_t offset) const {
+        return pattern.data() + (offset % kPeriod);
+    }
+};
+
+struct Scenario
+{
+    const char* name;
+    int64_t     count;      // 下载的文件数
+    int64_t     size;       // 每个文件的大小
+    int         parallel;   // 同时进行的下载数
+    int         latency;    // 服务端每个请求的延迟(毫秒)
+    int         resets;     // 服务端每发送一个数据块(64KiB)后重置连接的概率(千分之)
+};
+
+static const Scenario kScenarios[] = {
+    { "tiny",       10000, 4 * KiB,   16,  0,   0 },
+    { "huge",       1,     20 * GiB,  1,   0,   0 },
+    { "lossy",      1,     512 * MiB, 1,   0,   5 },
+    { "rtt",        1,     256 * MiB, 1,   100, 0 },
+    { "concurrent", 200,   8 * MiB,   200, 0,   0 },
+};
+
+static const Scenario* FindScenario(const std::string& name)
+{
+    for (auto const& s : kScenarios)
+        if (name == s.name)
+            return &s;
+    return nullptr;
+}
+
+//! 按比例缩放场景的规模: 文件数多于并发数时缩放文件数, 否则缩放文件大小
+static Scenario ScaleScenario(Scenario s, int64_t percent)
+{
+    if (s.count > s.parallel)
+        s.count = std::max<int64_t>(1, s.count * percent / 100);
+    else
+        s.size = std::max<int64_t>(4 * KiB, s.size * percent / 100);
+    return s;
+}
+
+//
+// 回环地址上的 HTTP 服务端, 每个连接一个线程, 支持 keep-alive, HEAD 及单个范围的 GET
+// 请求路径为 /<size>/<name>, 内容为长度为 size 的合成数据
+//
+class LoopbackServer
+{
+    using Socket = std::shared_ptr<asio::ip::tcp::socket>;
+
+    asio::io_context        _context;
+    asio::ip::tcp::acceptor _acceptor{ _context };
+    SyntheticData           _data;
+    unsigned short          _port = 0;
+    std::atomic<bool>       _stopped{ false };
+    std::thread             _accepter;
+    std::mutex              _mutex;
+
+    struct Connection
+    {
+        Socket            socket;
+        std::thread       thread;
+        std::atomic<bool> finished{ false }; // 线程即将退出, 可以回收
+    };
+    std::list<Connection>   _connections; // 由 _mutex 保护
+
+public:
+    std::atomic<int>        latency{ 0 };
+    std::atomic<int>        resets{ 0 };
+
+    ~LoopbackServer() {
+        stop();
+    }
+
+    unsigned short start()
+    {
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), 0);
+        _acceptor.open(endpoint.protocol());
+        _acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        _acceptor.bind(endpoint);
+        _acceptor.listen(asio::socket_base::max_listen_connections);
+
+        _port = _acceptor.local_endpoint().port();
+        _accepter = std::thread([this] {
+            int backoff = 0;
+            while (!_stopped)
+            {
+                auto socket = std::make_shared<asio::ip::tcp::socket>(_context);
+                boost::system::error_code ecode;
+                _acceptor.accept(*socket, ecode);
+                if (_stopped)
+                    break;
+                if (ecode)
+                {
+                    // 例如文件描述符耗尽(EMFILE), 立即重试只会空转并计入测量的 CPU 时间
+                    backoff = std::min(std::max(backoff * 2, 10), 1000);
+                    std::this_thread::sleep_for(chr::milliseconds(backoff));
+                    continue;
+                }
+
+                backoff = 0;
+                std::lock_guard<std::mutex> locker(_mutex);
+
+                // 回收已结束的连接, 否则大量的短连接(例如 tiny)会累积上万个未回收的线程
+                for (auto it = _connections.begin(); it != _connections.end();)
+                {
+                    if (!it->finished) {
+                        ++it;
+                        continue;
+                    }
+                    it->thread.join();
+                    it = _connections.erase(it);
+                }
+
+                auto& conn = _connections.emplace_back();
+                conn.socket = socket;
+                conn.thread = std::thread([this, &conn] {
+                    serve(*conn.socket);
+                    conn.finished = true;
+                });
+            }
+        });
+
+        return _port;
+    }
+
+    //! 停止接受连接, 断开所有的连接并等待其线程退出, 须在析构之前调用
+    void stop()
+    {
+        if (!_accepter.joinable())
+            return;
+
+        // 以一个连接唤醒阻塞的 accept()
+        _stopped = true;
+        {
+            asio::ip::tcp::socket wakeup(_context);
+            boost::system::error_code ecode;
+            wakeup.connect({ asio::ip::make_address("127.0.0.1"), _port }, ecode);
+            _accepter.join();
+        }
+        boost::system::error_code ecode;
+        _acceptor.close(ecode);
+
+        std::list<Connection> connections;
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            connections.swap(_connections);
+        }
+        for (auto& conn : connections)
+        {
+            conn.socket->shutdown(asio::socket_base::shutdown_both, ecode);
+            conn.thread.join();
+        }
+    }
+
+private:
+    void serve(asio::ip::tcp::socket& socket)
+    {
+        std::mt19937 gen(std::random_device{}());
+        std::uniform_int_distribution<int> permille(0, 999);
+        socket.set_option(asio::ip::tcp::no_delay(true));
+
+        asio::streambuf buffer;
+        boost::system::error_code ecode;
+        while (true)
+        {
+            auto bytes = asio::read_until(socket, buffer, "\r\n\r\n", ecode);
+            if (ecode)
+                return;
+
+            std::string request(asio::buffers_begin(buffer.data()), asio::buffers_begin(buffer.data()) + bytes);
+            buffer.consume(bytes);
+
+            std::istringstream stream(request);
+            std::string method, path, line;
+            stream >> method >> path;
+
+            int64_t size = std::strtoll(path.c_str() + (path.empty() ? 0 : 1), nullptr, 10);
+            int64_t start = 0, end = size - 1;
+            bool ranged = false;
+            while (std::getline(stream, line))
+            {
+                if (line.size() > 6 && (line.compare(0, 6, "Range:") == 0 || line.compare(0, 6, "range:") == 0))
+                {
+                    auto pos = line.find("bytes=");
+                    if (pos == std::string::npos)
+                        continue;
+                    char* tail = nullptr;
+                    start = std::strtoll(line.c_str() + pos + 6, &tail, 10);
+                    if (tail && *tail == '-' && tail[1] >= '0' && tail[1] <= '9')
+                        end = std::min<int64_t>(std::strtoll(tail + 1, nullptr, 10), size - 1);
+                    ranged = true;
+                }
+            }
+
+            if (latency > 0)
+                std::this_thread::sleep_for(chr::milliseconds(latency));
+
+            std::string header;
+            if (size <= 0 || start >= size)
+            {
+                header = ranged && size > 0
+                    ? "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + std::to_string(size) + "\r\n"
+                    : "HTTP/1.1 404 Not Found\r\n";
+                header += "Content-Length: 0\r\n\r\n";
+                if (!asio::write(socket, asio::buffer(header), ecode))
+                    return;
+                continue;
+            }
+
+            header = ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+            header += "Accept-Ranges: bytes\r\nETag: \"scenario\"\r\n";
+            header += "Content-Length: " + std::to_string(end - start + 1) + "\r\n";
+            if (ranged)
+                header += "Content-Range: bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(size) + "\r\n";
+            header += "\r\n";
+            asio::write(socket, asio::buffer(header), ecode);
+            if (ecode)
+                return;
+            if (method == "HEAD")
+                continue;
+
+            for (int64_t offset = start; offset <= end; offset += SyntheticData::kChunk)
+            {
+                auto chunk = std::min<int64_t>(SyntheticData::kChunk, end + 1 - offset);
+                asio::write(socket, asio::buffer(_data.at(offset), (size_t)chunk), ecode);
+                if (ecode)
+                    return;
+
+                if (resets > 0 && permille(gen) < resets)
+                {
+                    // 以 RST 终止连接, 模拟有损的链路
+                    socket.set_option(asio::socket_base::linger(true, 0), ecode);
+                    socket.close(ecode);
+                    return;
+                }
+            }
+        }
+    }
+};
+
+//
+// 进程的资源使用
+//
+static double CpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME create, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return (int64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e7;
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](const timeval& t) { return t.tv_sec + t.tv_usec / 1e6; };
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+}
+
+static int64_t PeakMemoryKiB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return (int64_t)counters.PeakWorkingSetSize / KiB;
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+#   ifdef __APPLE__
+    return usage.ru_maxrss / KiB; // 字节
+#   else
+    return usage.ru_maxrss;       // KiB
+#   endif
+#endif
+}
+
+static bool VerifyFile(const std::filesystem::path& filename, int64_t size)
+{
+    std::error_code ecode;
+    if ((int64_t)std::filesystem::file_size(filename, ecode) != size || ecode)
+        return false;
+
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<char> buffer(1024 * 1024);
+    for (int64_t offset = 0; offset < size; offset += buffer.size())
+    {
+        auto bytes = std::min<int64_t>(buffer.size(), size - offset);
+        if (!file.read(buffer.data(), bytes))
+            return false;
+        for (int64_t i = 0; i < bytes; ++i)
+            if (buffer[i] != SyntheticData::byte(offset + i))
+                return false;
+    }
+    return true;
+}
+
+//! 最近秩法的百分位数
+static double Percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    auto rank = (size_t)std::ceil(p / 100 * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+//
+// 子进程: 执行一个场景的下载, 将结果(JSON 对象)写入文件
+//
+static int RunChild(const Scenario& s, unsigned short port, const std::filesystem::path& directory, const std::string& output)
+{
+    std::atomic<int64_t> next(0);
+    std::atomic<int64_t> failed(0);
+    std::vector<double> durations(s.count);
+
+    auto filename = [&](int64_t i) {
+        return directory / (std::string(s.name) + "_" + std::to_string(i) + ".bin");
+    };
+
+    auto worker = [&] {
+        download_preference preference;
+        for (int64_t i; (i = next++) < s.count;)
+        {
+            auto url = "http://127.0.0.1:" + std::to_string(port) + "/" + std::to_string(s.size) + "/" + std::to_string(i);
+            auto start = chr::steady_clock::now();
+            std::error_code ecode;
+            if (!DownloadFile(url, filename(i), nullptr, preference, ecode)) {
+                std::cerr << "DownloadFile() failed, url: " << url << ", error: " << ecode.message() << std::endl;
+                failed++;
+            }
+            durations[i] = chr::duration<double, std::milli>(chr::steady_clock::now() - start).count();
+        }
+    };
+
+    auto cpu = CpuSeconds();
+    auto start = chr::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::min<int64_t>(s.parallel, s.count); ++i)
+        workers.emplace_back(worker);
+    for (auto& t : workers)
+        t.join();
+
+    auto elapse = chr::duration<double>(chr::steady_clock::now() - start).count();
+    cpu = CpuSeconds() - cpu;
+    auto memory = PeakMemoryKiB();
+
+    // 计时结束后校验并删除文件
+    int64_t corrupted = 0;
+    for (int64_t i = 0; i < s.count; ++i)
+    {
+        if (!VerifyFile(filename(i), s.size))
+            corrupted++;
+        std::error_code ecode;
+        std::filesystem::remove(filename(i), ecode);
+        std::filesystem::remove(std::filesystem::path(filename(i)) += ".meta", ecode);
+    }
+
+    std::ofstream json(output, std::ios::binary | std::ios::trunc);
+    char text[1024];
+    std::snprintf(text, sizeof(text),
+        "    {\n"
+        "      \"name\": \"%s\",\n"
+        "      \"downloads\": %lld,\n"
+        "      \"size\": %lld,\n"
+        "      \"failed\": %lld,\n"
+        "      \"corrupted\": %lld,\n"
+        "      \"seconds\": %.3f,\n"
+        "      \"throughput_mibps\": %.2f,\n"
+        "      \"p50_ms\": %.2f,\n"
+        "      \"p99_ms\": %.2f,\n"
+        "      \"cpu_seconds\": %.3f,\n"
+        "      \"peak_memory_kib\": %lld\n"
+        "    }",
+        s.name, (long long)s.count, (long long)s.size, (long long)failed.load(), (long long)corrupted,
+        elapse, s.count * s.size / elapse / MiB,
+        Percentile(durations, 50), Percentile(durations, 99),
+        cpu, (long long)memory);
+    json << text;
+    return json ? 0 : -1;
+}
+
+static std::string Quote(const std::string& arg) {
+    return "\"" + arg + "\"";
+}
+
+//
+// 父进程: 启动服务端, 在子进程中依次执行各个场景, 汇总结果
+//
+static int RunScenarios(const std::string& program, const std::string& output, int64_t scale,
+    const std::vector<std::string>& names, const std::filesystem::path& directory)
+{
+    LoopbackServer server;
+    auto port = server.start();
+
+    std::string results;
+    for (auto const& name : names)
+    {
+        auto s = ScaleScenario(*FindScenario(name), scale);
+        server.latency = s.latency;
+        server.resets = s.resets;
+
+        std::cout << "Running " << s.name << ", downloads: " << s.count << ", size: " << s.size
+                  << ", parallel: " << s.parallel << " ..." << std::endl;
+
+        auto fragment = directory / (std::string("scenario_") + s.name + ".json");
+        auto command = Quote(program) + " child " + s.name + " " + std::to_string(port) + " "
+            + std::to_string(scale) + " " + Quote(directory.string()) + " " + Quote(fragment.string());
+#ifdef _WIN32
+        command = Quote(command); // cmd /c 会去掉最外层的引号
+#endif
+        if (std::system(command.c_str()) != 0) {
+            std::cerr << "Scenario " << s.name << " failed to run" << std::endl;
+            return -1;
+        }
+
+        std::ifstream file(fragment, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        std::error_code ecode;
+        std::filesystem::remove(fragment, ecode);
+
+        std::cout << text << std::endl;
+        results += (results.empty() ? "" : ",\n") + text;
+    }
+    server.stop();
+
+    std::ofstream json(output, std::ios::binary | std::ios::trunc);
+    json << "{\n  \"scale\": " << scale << ",\n  \"scenarios\": [\n" << results << "\n  ]\n}\n";
+    if (!json) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return -1;
+    }
+    std::cout << "Results: " << output << std::endl;
+    return 0;
+}
+
+//
+// 比较模式: 任一指标变差超过阈值即为退化, 存在退化时返回 1
+//
+static int Compare(const std::string& baseline, const std::string& current, double threshold)
+{
+    namespace pt = boost::property_tree;
+    pt::ptree base, curr;
+    try
+    {
+        pt::read_json(baseline, base);
+        pt::read_json(current, curr);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Failed to read results: " << e.what() << std::endl;
+        return -1;
+    }
+
+    std::map<std::string, pt::ptree> scenarios;
+    for (auto const& item : base.get_child("scenarios"))
+        scenarios[item.second.get<std::string>("name")] = item.second;
+
+    struct Metric { const char* key; bool higherIsBetter; };
+    static const Metric kMetrics[] = {
+        { "throughput_mibps", true  },
+        { "p50_ms",           false },
+        { "p99_ms",           false },
+        { "cpu_seconds",      false },
+        { "peak_memory_kib",  false },
+    };
+
+    int regressions = 0;
+    for (auto const& item : curr.get_child("scenarios"))
+    {
+        auto name = item.second.get<std::string>("name");
+        auto it = scenarios.find(name);
+        if (it == scenarios.end()) {
+            std::cout << name << ": no baseline" << std::endl;
+            continue;
+        }
+
+        auto& before = it->second;
+        auto& after = item.second;
+        if (before.get<int64_t>("downloads") != after.get<int64_t>("downloads")
+            || before.get<int64_t>("size") != after.get<int64_t>("size")) {
+            std::cout << name << ": different scale, skipped" << std::endl;
+            continue;
+        }
+
+        auto errors = [](const pt::ptree& t) { return t.get<int64_t>("failed") + t.get<int64_t>("corrupted"); };
+        if (errors(after) > errors(before)) {
+            std::cout << util::sformat("%-10s %-18s %12lld -> %12lld  REGRESSION", name.c_str(), "failed",
+                (long long)errors(before), (long long)errors(after)) << std::endl;
+            regressions++;
+        }
+
+        for (auto const& m : kMetrics)
+        {
+            auto a = before.get<double>(m.key);
+            auto b = after.get<double>(m.key);
+            auto change = a > 0 ? (b - a) / a * 100 : 0.0;
+            bool regressed = m.higherIsBetter ? change < -threshold : change > threshold;
+            regressions += regressed;
+            std::cout << util::sformat("%-10s %-18s %12.2f -> %12.2f  %+7.1f%%%s", name.c_str(), m.key,
+                a, b, change, regressed ? "  REGRESSION" : "") << std::endl;
+        }
+    }
+
+    std::cout << (regressions ? util::sformat("%d regression(s), threshold: %.1f%%", regressions, threshold)
+                              : std::string("No regression")) << std::endl;
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    auto showHelp = []()
+        {
+            std::cerr << "Using scenario_bench run [output.json] [scale-%] [dir] [scenario ...]" << std::endl;
+            std::cerr << "      scenario_bench compare <baseline.json> <current.json> [threshold-%]" << std::endl;
+            std::cerr << "Scenarios:";
+            for (auto const& s : kScenarios)
+                std::cerr << " " << s.name;
+            std::cerr << std::endl;
+            return -2;
+        };
+
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "compare" && argc > 3)
+        return Compare(argv[2], argv[3], argc > 4 ? std::atof(argv[4]) : 10.0);
+
+    if (mode == "child" && argc > 6)
+    {
+        auto s = FindScenario(argv[2]);
+        if (s == nullptr)
+            return showHelp();
+        return RunChild(ScaleScenario(*s, std::atoll(argv[4])), (unsigned short)std::atoi(argv[3]), argv[5], argv[6]);
+    }
+
+    if (mode != "run")
+        return showHelp();
+
+    std::string output = argc > 2 ? argv[2] : "scenario_bench.json";
+    int64_t scale = argc > 3 ? std::atoll(argv[3]) : 100;
+    auto directory = argc > 4 ? std::filesystem::path(argv[4]) : std::filesystem::temp_directory_path();
+    std::vector<std::string> names;
+    for (int i = 5; i < argc; ++i)
+    {
+        if (FindScenario(argv[i]) == nullptr)
+            return showHelp();
+        names.push_back(argv[i]);
+    }
+    if (names.empty())
+        for (auto const& s : kScenarios)
+            names.push_back(s.name);
+    if (scale <= 0)
+        return showHelp();
+
+    return RunScenarios(argv[0], output, scale, names, directory);
+}